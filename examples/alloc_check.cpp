@@ -0,0 +1,105 @@
+#include "../src/a1.hpp"
+#include <glm/gtc/matrix_transform.hpp>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+// Checks that drawing does not allocate once the rasterizer is warmed up: after a first
+// frame, frames of clear, drawObject and show must not call operator new.
+// Usage: alloc_check [threads]
+
+namespace R = COL781::Software;
+using namespace glm;
+
+static long allocations = 0;
+static bool counting = false;
+
+void *operator new(size_t size)
+{
+    if (counting)
+    {
+        allocations++;
+    }
+    void *p = std::malloc(size ? size : 1);
+    if (p == NULL)
+    {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+int main(int argc, char **argv)
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 0;
+    R::Rasterizer r;
+    int width = 640, height = 480;
+    if (!r.initializeOffscreen(width, height, 4))
+        return EXIT_FAILURE;
+    r.setThreadCount(threads);
+
+    R::ShaderProgram program = r.createShaderProgram(r.vsColorTransform(), r.fsIdentity());
+    vec4 vertices[] = {
+        vec4(-0.8, -0.8, 0.0, 1.0),
+        vec4(0.8, -0.8, 0.0, 1.0),
+        vec4(-0.8, 0.8, 0.0, 1.0),
+        vec4(0.8, 0.8, 0.0, 1.0)};
+    vec4 colors[] = {
+        vec4(0.0, 0.4, 0.6, 1.0),
+        vec4(1.0, 1.0, 0.4, 1.0),
+        vec4(0.0, 0.4, 0.6, 1.0),
+        vec4(1.0, 1.0, 0.4, 1.0)};
+    ivec3 triangles[] = {ivec3(0, 1, 2), ivec3(1, 2, 3)};
+    R::Object shape = r.createObject();
+    r.setVertexAttribs(shape, 0, 4, vertices);
+    r.setVertexAttribs(shape, 1, 4, colors);
+    r.setTriangleIndices(shape, 2, triangles);
+    r.enableDepthTest();
+    mat4 view = translate(mat4(1.0f), vec3(0.0f, 0.0f, -2.0f));
+    mat4 projection = perspective(radians(60.0f), (float)width / (float)height, 0.1f, 100.0f);
+    int transform = r.getUniformLocation(program, "transform");
+
+    const int frames = 4;
+    long warm = 0;
+    for (int frame = 0; frame <= frames; frame++)
+    {
+        // the first frame sizes the buffers that later frames reuse
+        counting = frame > 0;
+        // the same frame each time, so that every tile's bin has been sized by the first
+        mat4 model = rotate(mat4(1.0f), radians(30.0f), vec3(1.0f, 0.0f, 0.0f));
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        r.setUniform(program, transform, projection * view * model);
+        r.drawObject(shape);
+        // the same object again, with shaders compiled into the pipeline
+        mat4 m = projection * view * translate(model, vec3(0.1f, 0.1f, -0.1f));
+        r.drawObject<1>(
+            shape,
+            [m](const R::Uniforms &, const R::Attribs &in, R::Attribs &out)
+            {
+                out.set<vec4>(0, in.get<vec4>(1));
+                return m * in.get<vec4>(0);
+            },
+            [](const R::Uniforms &, const R::Attribs &in)
+            {
+                return in.get<vec4>(0);
+            });
+        r.show();
+        if (frame == 0)
+        {
+            warm = allocations;
+        }
+    }
+    counting = false;
+    std::printf("%ld allocations in %d frames\n", allocations - warm, frames);
+    return allocations - warm > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,718 @@
+#include "../src/a1.hpp"
+#include <glm/gtc/matrix_transform.hpp>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// Renders fixed workloads offscreen and prints their timings as JSON.
+// Usage: bench [frames] [threads] [trace prefix] [auto|scalar|sse2|avx2]
+// With a trace prefix, the last frame of each scene is also saved as <prefix><scene>.json;
+// an empty one saves none. The last argument picks the kernel that rasterizes whole blocks.
+// Every frame of a scene is a function of its index alone, so runs are comparable.
+
+namespace R = COL781::Software;
+using namespace glm;
+
+// A workload: objects made once, and the draws of frame n.
+class Scene
+{
+public:
+    virtual ~Scene() {}
+    virtual void setup(R::Rasterizer &r, int width, int height) = 0;
+    virtual void draw(R::Rasterizer &r, int frame) = 0;
+};
+
+// Example 1: a tick mark in one colour.
+class TickScene : public Scene
+{
+    R::ShaderProgram program;
+    R::Object tick;
+
+public:
+    void setup(R::Rasterizer &r, int, int)
+    {
+        program = r.createShaderProgram(r.vsIdentity(), r.fsConstant());
+        vec4 vertices[] = {
+            vec4(-0.8, 0.0, 0.0, 1.0),
+            vec4(-0.4, -0.8, 0.0, 1.0),
+            vec4(0.8, 0.8, 0.0, 1.0),
+            vec4(-0.4, -0.4, 0.0, 1.0)};
+        ivec3 triangles[] = {ivec3(0, 1, 3), ivec3(1, 2, 3)};
+        tick = r.createObject();
+        r.setVertexAttribs(tick, 0, 4, vertices);
+        r.setTriangleIndices(tick, 2, triangles);
+    }
+
+    void draw(R::Rasterizer &r, int)
+    {
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        r.setUniform<vec4>(program, "color", vec4(0.0, 0.6, 0.0, 1.0));
+        r.drawObject(tick);
+    }
+};
+
+// Example 2: a square with interpolated colours.
+class ColorScene : public Scene
+{
+    R::ShaderProgram program;
+    R::Object shape;
+
+public:
+    void setup(R::Rasterizer &r, int, int)
+    {
+        program = r.createShaderProgram(r.vsColor(), r.fsIdentity());
+        vec4 vertices[] = {
+            vec4(0.0, -0.8, 0.0, 1.0),
+            vec4(0.8, 0.0, 0.0, 1.0),
+            vec4(0.0, 0.8, 0.0, 1.0),
+            vec4(-0.8, 0.0, 0.0, 1.0)};
+        vec4 colors[] = {
+            vec4(0.0, 0.0, 0.0, 1.0),
+            vec4(1.0, 0.0, 0.0, 1.0),
+            vec4(1.0, 1.0, 1.0, 1.0),
+            vec4(0.0, 0.0, 1.0, 1.0)};
+        ivec3 triangles[] = {ivec3(0, 1, 2), ivec3(0, 2, 3)};
+        shape = r.createObject();
+        r.setVertexAttribs(shape, 0, 4, vertices);
+        r.setVertexAttribs(shape, 1, 4, colors);
+        r.setTriangleIndices(shape, 2, triangles);
+    }
+
+    void draw(R::Rasterizer &r, int)
+    {
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        r.drawObject(shape);
+    }
+};
+
+// Example 3: three intersecting triangles, depth tested.
+class IntersectScene : public Scene
+{
+    R::ShaderProgram program;
+    R::Object box;
+
+public:
+    void setup(R::Rasterizer &r, int, int)
+    {
+        program = r.createShaderProgram(r.vsTransform(), r.fsConstant());
+        vec4 vertices[] = {
+            vec4(-0.5, -0.5, 0.0, 1.0),
+            vec4(0.25, 0.35, 0.2, 1.0),
+            vec4(-0.25, 0.5, 0.0, 1.0)};
+        ivec3 triangles[] = {ivec3(0, 1, 2)};
+        box = r.createObject();
+        r.setVertexAttribs(box, 0, 3, vertices);
+        r.setTriangleIndices(box, 1, triangles);
+        r.enableDepthTest();
+    }
+
+    void draw(R::Rasterizer &r, int)
+    {
+        float angles[] = {0.0f, 120.0f, -120.0f};
+        vec4 colors[] = {vec4(0.9, 0.6, 0.3, 1.0), vec4(0.8, 0.8, 0.8, 1.0), vec4(0.5, 0.5, 0.8, 1.0)};
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        for (int k = 0; k < 3; k++)
+        {
+            r.setUniform(program, "transform", rotate(mat4(1.0f), radians(angles[k]), vec3(0.0f, 0.0f, 1.0f)));
+            r.setUniform(program, "color", colors[k]);
+            r.drawObject(box);
+        }
+    }
+};
+
+// Example 4: two triangles that pierce each other, depth tested.
+class PierceScene : public Scene
+{
+    R::ShaderProgram program;
+    R::Object tri1, tri2;
+
+public:
+    void setup(R::Rasterizer &r, int, int)
+    {
+        program = r.createShaderProgram(r.vsIdentity(), r.fsConstant());
+        vec4 vertices1[] = {
+            vec4(-0.25, -0.4, 0, 1.0),
+            vec4(0.25, -0.4, 0, 1.0),
+            vec4(0.0, 0.8, 0.1, 1.0)};
+        vec4 vertices2[] = {
+            vec4(0.4, 0.4, 0, 1.0),
+            vec4(-0.4, 0.4, 0, 1.0),
+            vec4(0.0, -0.6, 0.2, 1.0)};
+        ivec3 triangles[] = {ivec3(0, 1, 2)};
+        tri1 = r.createObject();
+        r.setVertexAttribs(tri1, 0, 3, vertices1);
+        r.setTriangleIndices(tri1, 1, triangles);
+        tri2 = r.createObject();
+        r.setVertexAttribs(tri2, 0, 3, vertices2);
+        r.setTriangleIndices(tri2, 1, triangles);
+        r.enableDepthTest();
+    }
+
+    void draw(R::Rasterizer &r, int)
+    {
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        r.setUniform<vec4>(program, "color", vec4(0.9, 0.7, 0.5, 1.0));
+        r.drawObject(tri1);
+        r.setUniform<vec4>(program, "color", vec4(0.6, 0.6, 0.8, 1.0));
+        r.drawObject(tri2);
+    }
+};
+
+// Example 5: a square turning about the x axis in perspective.
+class PerspectiveScene : public Scene
+{
+    R::ShaderProgram program;
+    R::Object shape;
+    mat4 projection;
+
+public:
+    void setup(R::Rasterizer &r, int width, int height)
+    {
+        program = r.createShaderProgram(r.vsColorTransform(), r.fsIdentity());
+        vec4 vertices[] = {
+            vec4(-0.8, -0.8, 0.0, 1.0),
+            vec4(0.8, -0.8, 0.0, 1.0),
+            vec4(-0.8, 0.8, 0.0, 1.0),
+            vec4(0.8, 0.8, 0.0, 1.0)};
+        vec4 colors[] = {
+            vec4(0.0, 0.4, 0.6, 1.0),
+            vec4(1.0, 1.0, 0.4, 1.0),
+            vec4(0.0, 0.4, 0.6, 1.0),
+            vec4(1.0, 1.0, 0.4, 1.0)};
+        ivec3 triangles[] = {ivec3(0, 1, 2), ivec3(1, 2, 3)};
+        shape = r.createObject();
+        r.setVertexAttribs(shape, 0, 4, vertices);
+        r.setVertexAttribs(shape, 1, 4, colors);
+        r.setTriangleIndices(shape, 2, triangles);
+        r.enableDepthTest();
+        projection = perspective(radians(60.0f), (float)width / (float)height, 0.1f, 100.0f);
+    }
+
+    void draw(R::Rasterizer &r, int frame)
+    {
+        mat4 view = translate(mat4(1.0f), vec3(0.0f, 0.0f, -2.0f));
+        mat4 model = rotate(mat4(1.0f), radians(3.0f * frame), vec3(1.0f, 0.0f, 0.0f));
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        r.setUniform(program, "transform", projection * view * model);
+        r.drawObject(shape);
+    }
+};
+
+// The clock example with its hands at a fixed time, thin triangles at high spp.
+class ClockScene : public Scene
+{
+    R::ShaderProgram program;
+    R::Object square;
+
+    void drawBar(R::Rasterizer &r, float angle, vec3 size, vec3 offset)
+    {
+        mat4 m = rotate(mat4(1.0f), radians(angle), vec3(0.0f, 0.0f, 1.0f));
+        m = scale(m, size);
+        m = translate(m, offset);
+        r.setUniform(program, "transform", m);
+        r.drawObject(square);
+    }
+
+public:
+    void setup(R::Rasterizer &r, int, int)
+    {
+        program = r.createShaderProgram(r.vsTransform(), r.fsConstant());
+        vec4 vertices[] = {
+            vec4(0.0, 0.0, 0.0, 1.0),
+            vec4(1.0, 0.0, 0.0, 1.0),
+            vec4(0.0, 1.0, 0.0, 1.0),
+            vec4(1.0, 1.0, 0.0, 1.0)};
+        ivec3 triangles[] = {ivec3(0, 1, 2), ivec3(1, 2, 3)};
+        square = r.createObject();
+        r.setVertexAttribs(square, 0, 4, vertices);
+        r.setTriangleIndices(square, 2, triangles);
+    }
+
+    void draw(R::Rasterizer &r, int frame)
+    {
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        r.setUniform<vec4>(program, "color", vec4(0.0, 0.6, 0.0, 1.0));
+        for (int i = 0; i < 12; i++)
+        {
+            drawBar(r, -30.0f * i, vec3(0.04, 0.02, 1), vec3(15, -0.5f, 0));
+        }
+        // 10:10, and a second hand that moves with the frames
+        drawBar(r, -30.0f * 10 + 90.0f, vec3(0.2, 0.02, 1), vec3(0, -0.5f, 0));
+        drawBar(r, -6.0f * 10 + 90.0f, vec3(0.35, 0.01, 1), vec3(0, -0.5f, 0));
+        drawBar(r, -6.0f * frame + 90.0f, vec3(0.5, 0.006, 1), vec3(0, -0.5f, 0));
+    }
+};
+
+// The cubies of the Rubik's cube example, N along each side, turning, depth tested
+// with back faces culled. Each face of each cubie is an object of its own.
+template <int N = 3>
+class CubeScene : public Scene
+{
+protected:
+    R::ShaderProgram program;
+    std::vector<R::Object> faces;
+    std::vector<mat4> cubies;
+    std::vector<vec4> colors;
+    mat4 projection, view;
+
+    // see Cube in cube.cpp
+    R::Object createFace(R::Rasterizer &r, int f)
+    {
+        static ivec3 triangles[2] = {ivec3(0, 1, 2), ivec3(2, 1, 3)};
+        static ivec3 flipped[2] = {ivec3(0, 2, 1), ivec3(2, 3, 1)};
+        vec4 vertices[4]{
+            vec4(f > 2, f > 2, f > 2, 1.0),
+            vec4(f > 2, (f > 2) ^ (f % 3 == 0), (f > 2) ^ (f % 3 != 0), 1.0),
+            vec4((f > 2) ^ (f % 3 != 2), (f > 2) ^ (f % 3 == 2), f > 2, 1.0),
+            vec4((f > 2) ^ (f % 3 != 2), (f > 2) ^ (f % 3 != 1), (f > 2) ^ (f % 3 != 0), 1.0)};
+        R::Object face = r.createObject();
+        r.setVertexAttribs(face, 0, 4, vertices);
+        r.setTriangleIndices(face, 2, f % 2 ? flipped : triangles);
+        return face;
+    }
+
+    mat4 model(int frame)
+    {
+        return rotate(mat4(1.0f), radians(45.0f + frame), normalize(vec3(1.0, 1.0, 0.0)));
+    }
+
+public:
+    void setup(R::Rasterizer &r, int width, int height)
+    {
+        program = r.createShaderProgram(r.vsColorTransform(), r.fsIdentity());
+        float offset = 1.01f * (N - 1) / 2 + 0.5f;
+        for (int c = 0; c < N * N * N; c++)
+        {
+            int i = c / (N * N), j = c / N % N, k = c % N;
+            cubies.push_back(translate(mat4(1.0f), vec3(i * 1.01 - offset, j * 1.01 - offset, k * 1.01 - offset)));
+            for (int f = 0; f < 6; f++)
+            {
+                vec4 color((f * 37 + c * 11) % 256 / 255.0f, (f * 91 + c * 7) % 256 / 255.0f, f * 53 % 256 / 255.0f, 1.0f);
+                colors.push_back(color);
+                vec4 cs[] = {color, color, color, color};
+                R::Object face = createFace(r, f);
+                r.setVertexAttribs(face, 1, 4, cs);
+                faces.push_back(face);
+            }
+        }
+        r.enableDepthTest();
+        r.setCullMode(R::CullMode::Back);
+        projection = perspective(radians(60.0f), (float)width / (float)height, 0.1f, 80.0f);
+        view = translate(mat4(1.0f), vec3(0.0f, 0.0f, -7.0f * N / 3));
+    }
+
+    void draw(R::Rasterizer &r, int frame)
+    {
+        mat4 m = model(frame);
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        for (int c = 0; c < N * N * N; c++)
+        {
+            r.setUniform(program, "transform", projection * view * m * cubies[c]);
+            for (int f = 0; f < 6; f++)
+            {
+                r.drawObject(faces[6 * c + f]);
+            }
+        }
+    }
+};
+
+// The same cubies drawn as six instanced objects, one per face, with the transform and
+// colour of each cubie as instance attributes.
+template <int N = 3>
+class InstancedCubeScene : public CubeScene<N>
+{
+public:
+    void setup(R::Rasterizer &r, int width, int height)
+    {
+        CubeScene<N>::setup(r, width, height);
+        this->program = r.createShaderProgram(r.vsColorTransformInstanced(), r.fsIdentity());
+        this->faces.clear();
+        for (int f = 0; f < 6; f++)
+        {
+            std::vector<vec4> cs;
+            for (int c = 0; c < N * N * N; c++)
+            {
+                cs.push_back(this->colors[6 * c + f]);
+            }
+            R::Object face = this->createFace(r, f);
+            r.setInstanceAttribs(face, 1, cs.size(), cs.data());
+            r.setInstanceAttribs(face, 2, this->cubies.size(), this->cubies.data());
+            this->faces.push_back(face);
+        }
+    }
+
+    void draw(R::Rasterizer &r, int frame)
+    {
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(this->program);
+        r.setUniform(this->program, "transform", this->projection * this->view * this->model(frame));
+        for (int f = 0; f < 6; f++)
+        {
+            r.drawObjectInstanced(this->faces[f], N * N * N);
+        }
+    }
+};
+
+// Many small triangles: a finely tessellated sphere, turning.
+class MeshScene : public Scene
+{
+protected:
+    R::ShaderProgram program;
+    R::Object sphere;
+    mat4 projection;
+
+public:
+    void setup(R::Rasterizer &r, int width, int height)
+    {
+        program = r.createShaderProgram(r.vsColorTransform(), r.fsIdentity());
+        const int rings = 200, segments = 400;
+        std::vector<vec4> vertices, colors;
+        for (int i = 0; i <= rings; i++)
+        {
+            float theta = radians(180.0f) * i / rings;
+            for (int j = 0; j <= segments; j++)
+            {
+                float phi = radians(360.0f) * j / segments;
+                vec3 p(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+                vertices.push_back(vec4(p, 1.0f));
+                colors.push_back(vec4(0.5f * p + 0.5f, 1.0f));
+            }
+        }
+        std::vector<ivec3> triangles;
+        for (int i = 0; i < rings; i++)
+        {
+            for (int j = 0; j < segments; j++)
+            {
+                int v = i * (segments + 1) + j;
+                triangles.push_back(ivec3(v, v + 1, v + segments + 1));
+                triangles.push_back(ivec3(v + 1, v + segments + 2, v + segments + 1));
+            }
+        }
+        sphere = r.createObject();
+        r.setVertexAttribs(sphere, 0, vertices.size(), vertices.data());
+        r.setVertexAttribs(sphere, 1, colors.size(), colors.data());
+        r.setTriangleIndices(sphere, triangles.size(), triangles.data());
+        r.enableDepthTest();
+        r.setCullMode(R::CullMode::Back);
+        projection = perspective(radians(60.0f), (float)width / (float)height, 0.1f, 80.0f);
+    }
+
+    void draw(R::Rasterizer &r, int frame)
+    {
+        mat4 view = translate(mat4(1.0f), vec3(0.0f, 0.0f, -2.5f));
+        mat4 model = rotate(mat4(1.0f), radians(2.0f * frame), vec3(0.0f, 1.0f, 0.0f));
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        r.setUniform(program, "transform", projection * view * model);
+        r.drawObject(sphere);
+    }
+};
+
+// The same mesh, with its shaders inlined into the pipeline instead of called through
+// function pointers.
+class InlineMeshScene : public MeshScene
+{
+public:
+    void draw(R::Rasterizer &r, int frame)
+    {
+        mat4 view = translate(mat4(1.0f), vec3(0.0f, 0.0f, -2.5f));
+        mat4 model = rotate(mat4(1.0f), radians(2.0f * frame), vec3(0.0f, 1.0f, 0.0f));
+        mat4 transform = projection * view * model;
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        r.drawObject<1>(
+            sphere,
+            [transform](const R::Uniforms &, const R::Attribs &in, R::Attribs &out)
+            {
+                out.set<vec4>(0, in.get<vec4>(1));
+                return transform * in.get<vec4>(0);
+            },
+            [](const R::Uniforms &, const R::Attribs &in)
+            {
+                return in.get<vec4>(0);
+            });
+    }
+};
+
+// Few huge triangles: layers that cover the screen, drawn back to front so that
+// every one of them passes the depth test.
+class OverdrawScene : public Scene
+{
+protected:
+    R::ShaderProgram program;
+    R::Object layer;
+    float alpha = 1.0f;
+
+public:
+    void setup(R::Rasterizer &r, int, int)
+    {
+        program = r.createShaderProgram(r.vsTransform(), r.fsConstant());
+        vec4 vertices[] = {
+            vec4(-1.2, -1.2, 0.0, 1.0),
+            vec4(1.2, -1.2, 0.0, 1.0),
+            vec4(-1.2, 1.2, 0.0, 1.0),
+            vec4(1.2, 1.2, 0.0, 1.0)};
+        ivec3 triangles[] = {ivec3(0, 1, 2), ivec3(1, 3, 2)};
+        layer = r.createObject();
+        r.setVertexAttribs(layer, 0, 4, vertices);
+        r.setTriangleIndices(layer, 2, triangles);
+        r.enableDepthTest();
+    }
+
+    void draw(R::Rasterizer &r, int frame)
+    {
+        const int layers = 16;
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        for (int k = 0; k < layers; k++)
+        {
+            float depth = 0.9f - 1.8f * k / layers;
+            mat4 m = translate(mat4(1.0f), vec3(0.0f, 0.0f, depth));
+            m = rotate(m, radians(5.0f * k + frame), vec3(0.0f, 0.0f, 1.0f));
+            r.setUniform(program, "transform", m);
+            r.setUniform(program, "color", vec4((float)k / layers, 0.5, 1.0f - (float)k / layers, alpha));
+            r.drawObject(layer);
+        }
+    }
+};
+
+// The same layers, translucent, blended over each other.
+class BlendScene : public OverdrawScene
+{
+public:
+    void setup(R::Rasterizer &r, int width, int height)
+    {
+        OverdrawScene::setup(r, width, height);
+        alpha = 0.3f;
+        r.setBlending(true);
+        r.setBlendFunc(R::BlendFactor::SrcAlpha, R::BlendFactor::OneMinusSrcAlpha);
+    }
+};
+
+// A checkered floor stretching to the horizon, trilinear filtered, so that every
+// mipmap level is sampled.
+class TextureScene : public Scene
+{
+protected:
+    R::ShaderProgram program;
+    R::Object floor;
+    R::Texture texture;
+    mat4 projection;
+
+    mat4 transform(int frame)
+    {
+        mat4 view = translate(rotate(mat4(1.0f), radians(10.0f), vec3(1.0f, 0.0f, 0.0f)), vec3(0.0f, -1.0f, 0.0f));
+        return projection * view * rotate(mat4(1.0f), radians(0.5f * frame), vec3(0.0f, 1.0f, 0.0f));
+    }
+
+public:
+    void setup(R::Rasterizer &r, int width, int height)
+    {
+        program = r.createShaderProgram(r.vsTextureTransform(), r.fsTexture());
+        vec4 vertices[] = {
+            vec4(-50.0, 0.0, 50.0, 1.0),
+            vec4(50.0, 0.0, 50.0, 1.0),
+            vec4(-50.0, 0.0, -50.0, 1.0),
+            vec4(50.0, 0.0, -50.0, 1.0)};
+        vec2 texCoords[] = {vec2(0.0, 0.0), vec2(25.0, 0.0), vec2(0.0, 25.0), vec2(25.0, 25.0)};
+        ivec3 triangles[] = {ivec3(0, 1, 2), ivec3(1, 3, 2)};
+        floor = r.createObject();
+        r.setVertexAttribs(floor, 0, 4, vertices);
+        r.setVertexAttribs(floor, 1, 4, texCoords);
+        r.setTriangleIndices(floor, 2, triangles);
+        const int size = 256;
+        std::vector<Uint8> image(size * size * 4);
+        for (int y = 0; y < size; y++)
+        {
+            for (int x = 0; x < size; x++)
+            {
+                bool dark = (x / 32 + y / 32) % 2;
+                Uint8 *texel = &image[4 * (x + size * y)];
+                texel[0] = dark ? 40 : 230;
+                texel[1] = dark ? 60 : x;
+                texel[2] = dark ? 90 : y;
+                texel[3] = 255;
+            }
+        }
+        texture = r.createTexture();
+        r.setTextureData(texture, size, size, image.data());
+        r.generateMipmaps(texture);
+        r.setTextureFilter(texture, R::TextureFilter::Trilinear);
+        r.setTexture(program, "tex", texture);
+        projection = perspective(radians(60.0f), (float)width / (float)height, 0.1f, 100.0f);
+    }
+
+    void draw(R::Rasterizer &r, int frame)
+    {
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        r.setUniform(program, "transform", transform(frame));
+        r.drawObject(floor);
+    }
+};
+
+// The same floor, with a fragment shader that samples the texture for a whole quad at once.
+class QuadTextureScene : public TextureScene
+{
+public:
+    void draw(R::Rasterizer &r, int frame)
+    {
+        mat4 m = transform(frame);
+        const R::Texture *tex = &texture;
+        r.clear(vec4(1.0, 1.0, 1.0, 1.0));
+        r.useShaderProgram(program);
+        r.drawObject<1>(
+            floor,
+            [m](const R::Uniforms &, const R::Attribs &in, R::Attribs &out)
+            {
+                out.set<vec2>(0, in.get<vec2>(1));
+                return m * in.get<vec4>(0);
+            },
+            [tex](const R::Uniforms &, const R::FragmentQuad &quad, vec4 colors[4])
+            {
+                tex->sample(quad, 0, colors);
+            });
+    }
+};
+
+// Any of the scenes above, with its draws recorded and run at the end of the frame,
+// nearest first.
+template <typename S>
+class DeferredScene : public S
+{
+public:
+    void setup(R::Rasterizer &r, int width, int height)
+    {
+        S::setup(r, width, height);
+        r.setDeferred(true);
+        r.setSortDraws(true);
+    }
+};
+
+struct Workload
+{
+    const char *name;
+    int width, height, spp;
+    Scene *(*create)();
+};
+
+template <typename T>
+Scene *create()
+{
+    return new T();
+}
+
+const Workload workloads[] = {
+    {"e1", 640, 480, 1, create<TickScene>},
+    {"e2", 640, 480, 1, create<ColorScene>},
+    {"e3", 640, 480, 1, create<IntersectScene>},
+    {"e4", 640, 480, 1, create<PierceScene>},
+    {"e5", 640, 480, 1, create<PerspectiveScene>},
+    {"clock", 640, 640, 16, create<ClockScene>},
+    {"cube", 640, 480, 4, create<CubeScene<>>},
+    {"cube_deferred", 640, 480, 4, create<DeferredScene<CubeScene<>>>},
+    {"cube_instanced", 640, 480, 4, create<InstancedCubeScene<>>},
+    {"cubes", 640, 480, 4, create<CubeScene<12>>},
+    {"cubes_instanced", 640, 480, 4, create<InstancedCubeScene<12>>},
+    {"mesh", 640, 480, 1, create<MeshScene>},
+    {"mesh_inline", 640, 480, 1, create<InlineMeshScene>},
+    {"overdraw", 640, 480, 1, create<OverdrawScene>},
+    {"overdraw_deferred", 640, 480, 1, create<DeferredScene<OverdrawScene>>},
+    {"overdraw_blend", 640, 480, 1, create<BlendScene>},
+    {"texture", 640, 480, 1, create<TextureScene>},
+    {"texture_quad", 640, 480, 1, create<QuadTextureScene>},
+    {"e5_spp4", 640, 480, 4, create<PerspectiveScene>},
+    {"e5_spp16", 640, 480, 16, create<PerspectiveScene>},
+    {"cube_spp1", 640, 480, 1, create<CubeScene<>>},
+    {"cube_spp16", 640, 480, 16, create<CubeScene<>>},
+    {"mesh_spp16", 640, 480, 16, create<MeshScene>},
+    {"mesh_inline_spp16", 640, 480, 16, create<InlineMeshScene>},
+    {"overdraw_blend_spp4", 640, 480, 4, create<BlendScene>},
+};
+
+int main(int argc, char **argv)
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 100;
+    int threads = argc > 2 ? atoi(argv[2]) : 0;
+    const char *tracePrefix = argc > 3 && argv[3][0] != '\0' ? argv[3] : NULL;
+    const char *kernelName = argc > 4 ? argv[4] : "auto";
+    const int warmup = 3;
+    const char *kernelNames[] = {"auto", "scalar", "sse2", "avx2"};
+    int kernel = 0;
+    while (kernel < 4 && strcmp(kernelName, kernelNames[kernel]) != 0)
+    {
+        kernel++;
+    }
+    if (frames <= 0 || kernel == 4)
+    {
+        fprintf(stderr, "usage: %s [frames] [threads] [trace prefix] [auto|scalar|sse2|avx2]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("{\n  \"frames\": %d,\n  \"threads\": %d,\n  \"kernel\": \"%s\",\n  \"scenes\": [", frames, threads, kernelName);
+    int count = sizeof(workloads) / sizeof(workloads[0]);
+    for (int w = 0; w < count; w++)
+    {
+        const Workload &work = workloads[w];
+        R::Rasterizer r;
+        if (!r.initializeOffscreen(work.width, work.height, work.spp))
+            return EXIT_FAILURE;
+        r.setThreadCount(threads);
+        r.setBlockKernel((R::CoverageKernel)kernel);
+        r.setTracing(tracePrefix != NULL);
+        Scene *scene = work.create();
+        scene->setup(r, work.width, work.height);
+
+        for (int frame = 0; frame < warmup; frame++)
+        {
+            scene->draw(r, frame);
+            r.show();
+        }
+        R::FrameStats total;
+        double seconds = 0;
+        for (int frame = 0; frame < frames; frame++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            scene->draw(r, frame);
+            r.show();
+            seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            total += r.getFrameStats();
+        }
+        delete scene;
+        if (tracePrefix != NULL)
+        {
+            r.saveTrace(std::string(tracePrefix) + work.name + ".json");
+        }
+
+        double pixels = (double)work.width * work.height * frames;
+        printf("%s\n    {\n", w ? "," : "");
+        printf("      \"name\": \"%s\", \"width\": %d, \"height\": %d, \"spp\": %d,\n", work.name, work.width, work.height, work.spp);
+        printf("      \"frames_per_second\": %.2f,\n", frames / seconds);
+        printf("      \"triangles_per_second\": %.0f,\n", total.primitivesSubmitted / seconds);
+        printf("      \"pixels_per_second\": %.0f,\n", pixels / seconds);
+        printf("      \"fragments_per_second\": %.0f,\n", total.fragmentsShaded / seconds);
+        printf("      \"triangles_per_frame\": %.0f,\n", (double)total.primitivesSubmitted / frames);
+        printf("      \"milliseconds_per_frame\": {\"total\": %.3f, \"vertex\": %.3f, \"setup\": %.3f, \"raster\": %.3f, \"resolve\": %.3f},\n",
+               1e3 * seconds / frames, total.vertexMilliseconds / frames, total.setupMilliseconds / frames,
+               total.rasterMilliseconds / frames, total.resolveMilliseconds / frames);
+        printf("      \"counters_per_frame\": {\"vertices_shaded\": %.0f, \"primitives_clipped\": %.0f, \"primitives_culled\": %.0f, "
+               "\"faces_culled\": %.0f, \"samples_tested\": %.0f, \"samples_depth_rejected\": %.0f, \"hiz_samples_rejected\": %.0f, "
+               "\"fragments_shaded\": %.0f, \"samples_written\": %.0f}\n",
+               (double)total.verticesShaded / frames, (double)total.primitivesClipped / frames, (double)total.primitivesCulled / frames,
+               (double)total.facesCulled / frames, (double)total.samplesTested / frames, (double)total.samplesDepthRejected / frames,
+               (double)total.hizSamplesRejected / frames, (double)total.fragmentsShaded / frames, (double)total.samplesWritten / frames);
+        printf("    }");
+        fflush(stdout);
+    }
+    printf("\n  ]\n}\n");
+    return EXIT_SUCCESS;
+}
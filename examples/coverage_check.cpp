@@ -0,0 +1,87 @@
+#include "../src/a1.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+// Checks that meshes are watertight with rotated grid multisampling. A rectangle is split
+// into triangles around a vertex that is close to the long edge of one of them, so that
+// triangle has a sharp corner there, and every pixel inside the rectangle must be fully
+// covered, with the vertex at many points and the mesh both upright and transposed.
+// Usage: coverage_check [threads]
+
+namespace R = COL781::Software;
+using namespace glm;
+
+int main(int argc, char **argv)
+{
+    int threads = argc > 1 ? atoi(argv[1]) : 0;
+    const int size = 32;
+    R::Rasterizer r;
+    if (!r.initializeOffscreen(size, size, 4))
+        return EXIT_FAILURE;
+    r.setThreadCount(threads);
+    R::ShaderProgram program = r.createShaderProgram(r.vsColorTransform(), r.fsIdentity());
+    int transform = r.getUniformLocation(program, "transform");
+
+    // the rectangle [0, 8] x [0, 10] in pixels around vertex 0, moved to (8, 8), which puts
+    // the vertex next to the edge of a block of samples
+    vec2 corners[] = {vec2(4.25f, 0.0f), vec2(4.25f, 10.0f), vec2(0.0f, 0.0f), vec2(0.0f, 10.0f), vec2(8.0f, 0.0f), vec2(8.0f, 10.0f)};
+    ivec3 triangles[] = {ivec3(0, 1, 2), ivec3(3, 1, 0), ivec3(3, 0, 4), ivec3(4, 0, 2), ivec3(1, 5, 6), ivec3(1, 6, 2)};
+    vec4 colors[7];
+    for (vec4 &color : colors)
+    {
+        color = vec4(1.0f, 1.0f, 1.0f, 1.0f);
+    }
+    R::Object mesh = r.createObject();
+    r.setVertexAttribs(mesh, 1, 7, colors);
+    r.setTriangleIndices(mesh, 6, triangles);
+
+    int failures = 0;
+    std::vector<Uint8> rgba(size * size * 4);
+    for (int transposed = 0; transposed < 2; transposed++)
+    {
+        for (int n = 0; n < 64; n++)
+        {
+            // vertex 0 up to a pixel left of the edge between vertices 1 and 2
+            vec2 points[7] = {vec2(3.25f + n / 64.0f, 4.75f)};
+            for (int k = 0; k < 6; k++)
+            {
+                points[k + 1] = corners[k];
+            }
+            vec4 vertices[7];
+            for (int k = 0; k < 7; k++)
+            {
+                vec2 p = points[k] + vec2(8.0f, 8.0f);
+                if (transposed)
+                {
+                    p = vec2(p.y, p.x);
+                }
+                // from pixels to normalized device coordinates
+                vertices[k] = vec4(2.0f * p.x / size - 1.0f, 2.0f * p.y / size - 1.0f, 0.0f, 1.0f);
+            }
+            r.setVertexAttribs(mesh, 0, 7, vertices);
+            r.clear(vec4(0.0f, 0.0f, 0.0f, 1.0f));
+            r.useShaderProgram(program);
+            r.setUniform(program, transform, mat4(1.0f));
+            r.drawObject(mesh);
+            r.show();
+            r.readPixels(rgba.data());
+            for (int y = 0; y < size; y++)
+            {
+                for (int x = 0; x < size; x++)
+                {
+                    // rows are read from the top; a sample missed of four takes a quarter off
+                    int i = transposed ? size - 1 - y : x, j = transposed ? x : size - 1 - y;
+                    if (i > 8 && i < 15 && j > 8 && j < 17 && rgba[4 * (x + size * y)] < 224)
+                    {
+                        std::printf("vertex at (%g, 4.75)%s: pixel (%d, %d) is %d\n", points[0].x, transposed ? ", transposed" : "",
+                                    x, y, rgba[4 * (x + size * y)]);
+                        failures++;
+                    }
+                }
+            }
+        }
+    }
+    std::printf("%d pixels not covered\n", failures);
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
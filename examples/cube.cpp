@@ -25,9 +25,14 @@ class Cube
 {
     std::vector<R::Object> faces;
     mat4 t;
+    // counter-clockwise seen from outside; faces 1, 3 and 5 list their corners
+    // the other way round, so they use the flipped order
     ivec3 triangles[2]{
         ivec3(0, 1, 2),
-        ivec3(1, 2, 3)};
+        ivec3(2, 1, 3)};
+    ivec3 flipped[2]{
+        ivec3(0, 2, 1),
+        ivec3(2, 3, 1)};
 
 public:
     Cube(R::Rasterizer &r, const vec4 colors[6], const mat4 &transformation = mat4(1.0f)) : t(transformation)
@@ -52,7 +57,7 @@ public:
             R::Object shape = r.createObject();
             r.setVertexAttribs(shape, 0, 4, vertices);
             r.setVertexAttribs(shape, 1, 4, cs);
-            r.setTriangleIndices(shape, 2, triangles);
+            r.setTriangleIndices(shape, 2, i % 2 ? flipped : triangles);
             faces.push_back(shape);
         }
     }
@@ -235,7 +240,7 @@ class Arrows
     std::vector<R::Object> arrows;
 
 public:
-    Arrows(R::Rasterizer &r, const vec4 &color = vec4(200, 200, 200, 255) / 255.0f)
+    Arrows(R::Rasterizer &r, const vec4 &color = vec4(200, 200, 200, 160) / 255.0f)
     {
         vec4 vertices[3]{
             vec4(-0.05, 0.85, -1.0, 1.0f),
@@ -271,13 +276,19 @@ public:
             arrows.push_back(shape);
         }
     }
+    // drawn over the scene, translucent, without hiding what is drawn after them
     void draw(R::Rasterizer &r, R::ShaderProgram &program, mat4 t = mat4(1.0f))
     {
         r.setUniform(program, "transform", t);
+        r.setBlending(true);
+        r.setBlendFunc(R::BlendFactor::SrcAlpha, R::BlendFactor::OneMinusSrcAlpha);
+        r.setDepthMask(false);
         for (R::Object &o : arrows)
         {
             r.drawObject(o);
         }
+        r.setBlending(false);
+        r.setDepthMask(true);
     }
 };
 
@@ -296,6 +307,7 @@ int main()
     Arrows arrows(r);
     // 3d
     r.enableDepthTest();
+    r.setCullMode(R::CullMode::Back);
     // The transformation matrix.
     mat4 model = rotate(mat4(1.0f), radians(45.0f), normalize(vec3(1.0, 1.0, 0.0)));
     mat4 view = translate(mat4(1.0f), vec3(0.0f, 0.0f, -7.0f));
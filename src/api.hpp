@@ -24,6 +24,12 @@ public:
 	// T is only allowed to be float, int, glm::vec2/3/4, glm::mat2/3/4.
 	template <typename T> void setUniform(ShaderProgram &program, const std::string &name, T value);
 
+	// Returns the location of a uniform variable, so it can be set without a name lookup.
+	int getUniformLocation(ShaderProgram &program, const std::string &name);
+
+	// Sets the value of the uniform variable at the given location.
+	template <typename T> void setUniform(ShaderProgram &program, int location, T value);
+
 	// Deletes the given shader program.
 	void deleteShaderProgram(ShaderProgram &program);
 
@@ -41,18 +47,83 @@ public:
 	// Sets the indices of the triangles.
 	void setTriangleIndices(Object &object, int n, glm::ivec3* indices);
 
+	// Sets the data for the i'th vertex attribute, with one value per instance instead of per vertex.
+	// T is only allowed to be float, glm::vec2, glm::vec3, glm::vec4, or glm::mat4, which takes
+	// attributes i to i+3, one per column.
+	template <typename T> void setInstanceAttribs(Object &object, int attribIndex, int n, const T* data);
+
+	/** Textures **/
+
+	// Creates an empty texture. Textures are bilinear filtered and repeat by default.
+	Texture createTexture();
+
+	// Sets the image of a texture to width*height RGBA texels, 4 bytes each, in rows from
+	// the bottom up. Any mipmaps are dropped.
+	void setTextureData(Texture &texture, int width, int height, const Uint8 *rgba);
+
+	// Makes the mipmaps of the texture from its image, each level halving the last.
+	void generateMipmaps(Texture &texture);
+
+	// Sets how the texture is filtered, and how coordinates outside it wrap.
+	void setTextureFilter(Texture &texture, TextureFilter filter);
+	void setTextureWrap(Texture &texture, TextureWrap wrap);
+
+	// Sets the texture that the sampler uniform with the given name refers to.
+	void setTexture(ShaderProgram &program, const std::string &name, const Texture &texture);
+
+	// Deletes the given texture.
+	void deleteTexture(Texture &texture);
+
 	/** Drawing **/
 	
 
 	// Enable depth testing.
 	void enableDepthTest();
 
+	// Sets the depth test used when depth testing is enabled. Less by default.
+	void setDepthFunc(DepthFunc func);
+
+	// Sets which faces are culled. Nothing is culled by default.
+	void setCullMode(CullMode mode);
+
+	// Sets the winding of front faces. Counter-clockwise by default.
+	void setFrontFace(Winding winding);
+
+	// Blends fragments with the stored colours instead of replacing them. Off by default.
+	void setBlending(bool enabled);
+
+	// Sets the factors of the fragment's colour and of the stored one, for all channels or
+	// separately for alpha. SrcAlpha and OneMinusSrcAlpha composite translucent fragments.
+	// One and Zero by default.
+	void setBlendFunc(BlendFactor src, BlendFactor dst);
+	void setBlendFunc(BlendFactor srcColor, BlendFactor dstColor, BlendFactor srcAlpha, BlendFactor dstAlpha);
+
+	// Sets how the scaled colours are combined, for all channels or separately for alpha. Add by default.
+	void setBlendEquation(BlendEquation equation);
+	void setBlendEquation(BlendEquation color, BlendEquation alpha);
+
+	// Sets the colour that the constant blend factors take. Transparent black by default.
+	void setBlendColor(glm::vec4 color);
+
+	// Sets which channels of the colours, and whether depths, are written. Clears write
+	// them all regardless. Everything is written by default.
+	void setColorMask(bool red, bool green, bool blue, bool alpha);
+	void setDepthMask(bool write);
+
 	// Clear the framebuffer, setting all pixels to the given color.
 	void clear(glm::vec4 color);
 
+	// Clears only the colours, or only the depths. Depths are in [0, 1], 1 is the far plane.
+	void clearColor(glm::vec4 color);
+	void clearDepth(float depth);
+
 	// Draws the triangles of the given object.
 	void drawObject(const Object &object);
 
+	// Draws instanceCount copies of the object, which differ in their instance attributes
+	// and in their instance ID (gl_InstanceID).
+	void drawObjectInstanced(const Object &object, int instanceCount);
+
 	// Displays the framebuffer on the screen.
 	void show(); 
 
@@ -70,13 +141,32 @@ public:
 	// A vertex shader that handles both transformation and color attributes.
 	VertexShader vsColorTransform();
 
+	// Like vsColorTransform, applying the matrix in attributes 2 to 5, usually set per instance, before 'transform'.
+	VertexShader vsColorTransformInstanced();
+
 	// A fragment shader that returns a constant colour given by the uniform named 'color'.
 	FragmentShader fsConstant(); 
 
 	// A fragment shader that uses the 0th attribute as the color.
 	FragmentShader fsIdentity(); 
 
+	// A vertex shader that applies 'transform' and passes on the 1th attribute as texture coordinates.
+	VertexShader vsTextureTransform();
+
+	// A fragment shader that samples the texture named 'tex' at the coordinates in the 0th attribute.
+	FragmentShader fsTexture();
+
 private:
 	SDL_Window *window;
 	bool quit;
+	// textures set on each program, by texture unit; bound again whenever the program is used
+	struct Sampler {
+		GLint location;
+		GLuint texture;
+	};
+	std::map<ShaderProgram, std::vector<Sampler>> samplers;
+	// write masks, which clears lift while they run
+	GLboolean colorMask[4] = {GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE};
+	GLboolean depthMask = GL_TRUE;
+	void clearBuffers(GLbitfield buffers);
 };
@@ -1,5 +1,6 @@
 #include "hw.hpp"
 
+#include <algorithm>
 #include <iostream>
 #include <vector>
 
@@ -98,6 +99,11 @@ namespace COL781 {
 
 		void Rasterizer::useShaderProgram(const ShaderProgram &program) {
 			glUseProgram(program);
+			std::vector<Sampler> &units = samplers[program];
+			for (size_t unit = 0; unit < units.size(); unit++) {
+				glActiveTexture(GL_TEXTURE0 + unit);
+				glBindTexture(GL_TEXTURE_2D, units[unit].texture);
+			}
 			glCheckError();
 		}
 
@@ -149,7 +155,54 @@ namespace COL781 {
 			glCheckError();
 		}
 
+		int Rasterizer::getUniformLocation(ShaderProgram &program, const std::string &name) {
+			GLint location = glGetUniformLocation(program, name.c_str());
+			glCheckError();
+			return location;
+		}
+
+		template <> void Rasterizer::setUniform(ShaderProgram &, int location, float value) {
+			glUniform1f(location, value);
+			glCheckError();
+		}
+
+		template <> void Rasterizer::setUniform(ShaderProgram &, int location, int value) {
+			glUniform1i(location, value);
+			glCheckError();
+		}
+
+		template <> void Rasterizer::setUniform(ShaderProgram &, int location, glm::vec2 value) {
+			glUniform2fv(location, 1, &value[0]);
+			glCheckError();
+		}
+
+		template <> void Rasterizer::setUniform(ShaderProgram &, int location, glm::vec3 value) {
+			glUniform3fv(location, 1, &value[0]);
+			glCheckError();
+		}
+
+		template <> void Rasterizer::setUniform(ShaderProgram &, int location, glm::vec4 value) {
+			glUniform4fv(location, 1, &value[0]);
+			glCheckError();
+		}
+
+		template <> void Rasterizer::setUniform(ShaderProgram &, int location, glm::mat2 value) {
+			glUniformMatrix2fv(location, 1, GL_FALSE, &value[0][0]);
+			glCheckError();
+		}
+
+		template <> void Rasterizer::setUniform(ShaderProgram &, int location, glm::mat3 value) {
+			glUniformMatrix3fv(location, 1, GL_FALSE, &value[0][0]);
+			glCheckError();
+		}
+
+		template <> void Rasterizer::setUniform(ShaderProgram &, int location, glm::mat4 value) {
+			glUniformMatrix4fv(location, 1, GL_FALSE, &value[0][0]);
+			glCheckError();
+		}
+
 		void Rasterizer::deleteShaderProgram(ShaderProgram &program) {
+			samplers.erase(program);
 			glDeleteProgram(program);
 			glCheckError();
 		}
@@ -161,14 +214,18 @@ namespace COL781 {
 			return object;
 		}
 
-		void setAttribs(Object &object, int attribIndex, int n, int d, const float* data) {
+		void setAttribs(Object &object, int attribIndex, int n, int d, const float* data, GLuint divisor = 0) {
 			GLuint vbo;
 			glGenBuffers(1, &vbo);
 			glBindVertexArray(object.vao);
 			glBindBuffer(GL_ARRAY_BUFFER, vbo);
 			glBufferData(GL_ARRAY_BUFFER, n*d*sizeof(float), data, GL_STATIC_DRAW);
-			glVertexAttribPointer(attribIndex, d, GL_FLOAT, GL_FALSE, d*sizeof(float), NULL);
-			glEnableVertexAttribArray(attribIndex);
+			// attributes of more than 4 floats take one slot per 4
+			for (int k = 0; 4*k < d; k++) {
+				glVertexAttribPointer(attribIndex + k, std::min(d - 4*k, 4), GL_FLOAT, GL_FALSE, d*sizeof(float), (void*)(4*k*sizeof(float)));
+				glEnableVertexAttribArray(attribIndex + k);
+				glVertexAttribDivisor(attribIndex + k, divisor);
+			}
 			glCheckError();
 		}
 
@@ -188,6 +245,26 @@ namespace COL781 {
 			setAttribs(object, attribIndex, n, 4, (float*)data);
 		}
 
+		template <> void Rasterizer::setInstanceAttribs(Object &object, int attribIndex, int n, const float* data) {
+			setAttribs(object, attribIndex, n, 1, data, 1);
+		}
+
+		template <> void Rasterizer::setInstanceAttribs(Object &object, int attribIndex, int n, const glm::vec2* data) {
+			setAttribs(object, attribIndex, n, 2, (float*)data, 1);
+		}
+
+		template <> void Rasterizer::setInstanceAttribs(Object &object, int attribIndex, int n, const glm::vec3* data) {
+			setAttribs(object, attribIndex, n, 3, (float*)data, 1);
+		}
+
+		template <> void Rasterizer::setInstanceAttribs(Object &object, int attribIndex, int n, const glm::vec4* data) {
+			setAttribs(object, attribIndex, n, 4, (float*)data, 1);
+		}
+
+		template <> void Rasterizer::setInstanceAttribs(Object &object, int attribIndex, int n, const glm::mat4* data) {
+			setAttribs(object, attribIndex, n, 16, (float*)data, 1);
+		}
+
 		void Rasterizer::setTriangleIndices(Object &object, int n, glm::ivec3* indices) {
 			GLuint ebo;
 			glGenBuffers(1, &ebo);
@@ -197,16 +274,187 @@ namespace COL781 {
 			object.nTris = n;
 			glCheckError();
 		}
+
+		Texture Rasterizer::createTexture() {
+			Texture texture;
+			glGenTextures(1, &texture.id);
+			glCheckError();
+			setTextureFilter(texture, TextureFilter::Bilinear);
+			setTextureWrap(texture, TextureWrap::Repeat);
+			return texture;
+		}
+
+		// Binds a texture to the active unit while it is edited, and then binds back the
+		// texture that was there, which the current program may be sampling.
+		class TextureEdit {
+		public:
+			explicit TextureEdit(GLuint id) {
+				glGetIntegerv(GL_TEXTURE_BINDING_2D, &previous);
+				glBindTexture(GL_TEXTURE_2D, id);
+			}
+			~TextureEdit() {
+				glBindTexture(GL_TEXTURE_2D, previous);
+			}
+		private:
+			GLint previous;
+		};
+
+		void Rasterizer::setTextureData(Texture &texture, int width, int height, const Uint8 *rgba) {
+			TextureEdit edit(texture.id);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+			// levels past 0 are only sampled once generateMipmaps has made them
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+			glCheckError();
+		}
+
+		void Rasterizer::generateMipmaps(Texture &texture) {
+			TextureEdit edit(texture.id);
+			glGenerateMipmap(GL_TEXTURE_2D);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 1000);
+			glCheckError();
+		}
+
+		void Rasterizer::setTextureFilter(Texture &texture, TextureFilter filter) {
+			static const GLint minFilters[] = {GL_NEAREST_MIPMAP_NEAREST, GL_LINEAR_MIPMAP_NEAREST, GL_LINEAR_MIPMAP_LINEAR};
+			TextureEdit edit(texture.id);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, minFilters[(int)filter]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter == TextureFilter::Nearest ? GL_NEAREST : GL_LINEAR);
+			glCheckError();
+		}
+
+		void Rasterizer::setTextureWrap(Texture &texture, TextureWrap wrap) {
+			static const GLint wraps[] = {GL_REPEAT, GL_MIRRORED_REPEAT, GL_CLAMP_TO_EDGE};
+			TextureEdit edit(texture.id);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wraps[(int)wrap]);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wraps[(int)wrap]);
+			glCheckError();
+		}
+
+		void Rasterizer::setTexture(ShaderProgram &program, const std::string &name, const Texture &texture) {
+			// each sampler of a program gets its own unit, in the order they are first set
+			GLint location = glGetUniformLocation(program, name.c_str());
+			std::vector<Sampler> &units = samplers[program];
+			size_t unit = 0;
+			while (unit < units.size() && units[unit].location != location) {
+				unit++;
+			}
+			if (unit == units.size()) {
+				units.push_back(Sampler{location, 0});
+			}
+			units[unit].texture = texture.id;
+			glUniform1i(location, unit);
+			glActiveTexture(GL_TEXTURE0 + unit);
+			glBindTexture(GL_TEXTURE_2D, texture.id);
+			glCheckError();
+		}
+
+		void Rasterizer::deleteTexture(Texture &texture) {
+			glDeleteTextures(1, &texture.id);
+			glCheckError();
+		}
 		
 		void Rasterizer::enableDepthTest() {
 			glEnable(GL_DEPTH_TEST);
-		    glDepthFunc(GL_LESS);   
 			glCheckError();
 		}
 
+		void Rasterizer::setDepthFunc(DepthFunc func) {
+			static const GLenum funcs[] = {GL_NEVER, GL_LESS, GL_EQUAL, GL_LEQUAL, GL_GREATER, GL_NOTEQUAL, GL_GEQUAL, GL_ALWAYS};
+			glDepthFunc(funcs[(int)func]);
+			glCheckError();
+		}
+
+		void Rasterizer::setCullMode(CullMode mode) {
+			if (mode == CullMode::None) {
+				glDisable(GL_CULL_FACE);
+			} else {
+				glEnable(GL_CULL_FACE);
+				glCullFace(mode == CullMode::Front ? GL_FRONT : GL_BACK);
+			}
+			glCheckError();
+		}
+
+		void Rasterizer::setFrontFace(Winding winding) {
+			glFrontFace(winding == Winding::CounterClockwise ? GL_CCW : GL_CW);
+			glCheckError();
+		}
+
+		void Rasterizer::setBlending(bool enabled) {
+			if (enabled) {
+				glEnable(GL_BLEND);
+			} else {
+				glDisable(GL_BLEND);
+			}
+			glCheckError();
+		}
+
+		void Rasterizer::setBlendFunc(BlendFactor src, BlendFactor dst) {
+			setBlendFunc(src, dst, src, dst);
+		}
+
+		void Rasterizer::setBlendFunc(BlendFactor srcColor, BlendFactor dstColor, BlendFactor srcAlpha, BlendFactor dstAlpha) {
+			static const GLenum blendFactors[] = {
+				GL_ZERO, GL_ONE, GL_SRC_COLOR, GL_ONE_MINUS_SRC_COLOR, GL_DST_COLOR, GL_ONE_MINUS_DST_COLOR,
+				GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_DST_ALPHA, GL_ONE_MINUS_DST_ALPHA,
+				GL_CONSTANT_COLOR, GL_ONE_MINUS_CONSTANT_COLOR, GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA};
+			glBlendFuncSeparate(blendFactors[(int)srcColor], blendFactors[(int)dstColor], blendFactors[(int)srcAlpha], blendFactors[(int)dstAlpha]);
+			glCheckError();
+		}
+
+		void Rasterizer::setBlendEquation(BlendEquation equation) {
+			setBlendEquation(equation, equation);
+		}
+
+		void Rasterizer::setBlendEquation(BlendEquation color, BlendEquation alpha) {
+			static const GLenum equations[] = {GL_FUNC_ADD, GL_FUNC_SUBTRACT, GL_FUNC_REVERSE_SUBTRACT, GL_MIN, GL_MAX};
+			glBlendEquationSeparate(equations[(int)color], equations[(int)alpha]);
+			glCheckError();
+		}
+
+		void Rasterizer::setBlendColor(glm::vec4 color) {
+			glBlendColor(color[0], color[1], color[2], color[3]);
+			glCheckError();
+		}
+
+		void Rasterizer::setColorMask(bool red, bool green, bool blue, bool alpha) {
+			colorMask[0] = red;
+			colorMask[1] = green;
+			colorMask[2] = blue;
+			colorMask[3] = alpha;
+			glColorMask(red, green, blue, alpha);
+			glCheckError();
+		}
+
+		void Rasterizer::setDepthMask(bool write) {
+			depthMask = write;
+			glDepthMask(write);
+			glCheckError();
+		}
+
+		// Clears write every channel and the depths, whatever the masks, as in the software rasterizer.
+		void Rasterizer::clearBuffers(GLbitfield buffers) {
+			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+			glDepthMask(GL_TRUE);
+			glClear(buffers);
+			glColorMask(colorMask[0], colorMask[1], colorMask[2], colorMask[3]);
+			glDepthMask(depthMask);
+		}
+
 		void Rasterizer::clear(glm::vec4 color) {
 			glClearColor(color[0], color[1], color[2], color[3]);
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			clearBuffers(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+			glCheckError();
+		}
+
+		void Rasterizer::clearColor(glm::vec4 color) {
+			glClearColor(color[0], color[1], color[2], color[3]);
+			clearBuffers(GL_COLOR_BUFFER_BIT);
+			glCheckError();
+		}
+
+		void Rasterizer::clearDepth(float depth) {
+			glClearDepth(depth);
+			clearBuffers(GL_DEPTH_BUFFER_BIT);
 			glCheckError();
 		}
 
@@ -250,6 +498,12 @@ namespace COL781 {
 			glCheckError();
 		}
 
+		void Rasterizer::drawObjectInstanced(const Object &object, int instanceCount) {
+			glBindVertexArray(object.vao);
+			glDrawElementsInstanced(GL_TRIANGLES, 3*object.nTris, GL_UNSIGNED_INT, 0, instanceCount);
+			glCheckError();
+		}
+
 		void Rasterizer::show() {
 			SDL_GL_SwapWindow(window);
 			SDL_Event e;
@@ -329,6 +583,21 @@ namespace COL781 {
 			return createShader(GL_VERTEX_SHADER, source);
 		}
 
+		VertexShader Rasterizer::vsColorTransformInstanced() {
+			const char *source =
+				"#version 330 core\n"
+				"layout(location = 0) in vec4 vertex;\n"
+				"layout(location = 1) in vec4 vColor;\n"
+				"layout(location = 2) in mat4 instanceTransform;\n"
+				"uniform mat4 transform;\n"
+				"out vec4 color;\n"
+				"void main() {\n"
+				"	gl_Position = transform * (instanceTransform * vertex);\n"
+				"	color = vColor;\n"
+				"}\n";
+			return createShader(GL_VERTEX_SHADER, source);
+		}
+
 		FragmentShader Rasterizer::fsConstant() {
 			const char *source =
 				"#version 330 core\n"  
@@ -351,5 +620,31 @@ namespace COL781 {
 			return createShader(GL_FRAGMENT_SHADER, source);
 		}
 
+		VertexShader Rasterizer::vsTextureTransform() {
+			const char *source =
+				"#version 330 core\n"
+				"layout(location = 0) in vec4 vertex;\n"
+				"layout(location = 1) in vec2 vTexCoord;\n"
+				"uniform mat4 transform;\n"
+				"out vec2 texCoord;\n"
+				"void main() {\n"
+				"	gl_Position = transform * vertex;\n"
+				"	texCoord = vTexCoord;\n"
+				"}\n";
+			return createShader(GL_VERTEX_SHADER, source);
+		}
+
+		FragmentShader Rasterizer::fsTexture() {
+			const char *source =
+				"#version 330 core\n"
+				"in vec2 texCoord;\n"
+				"uniform sampler2D tex;\n"
+				"out vec4 fColor;\n"
+				"void main() {\n"
+				"	fColor = texture(tex, texCoord);\n"
+				"}\n";
+			return createShader(GL_FRAGMENT_SHADER, source);
+		}
+
 	}
 }
@@ -3,8 +3,10 @@
 
 #include <GL/glew.h>
 #include <glm/glm.hpp>
+#include <map>
 #include <SDL2/SDL.h>
 #include <string>
+#include <vector>
 
 namespace COL781 {
 	namespace Hardware {
@@ -14,11 +16,44 @@ namespace COL781 {
 
 		using ShaderProgram = GLuint;
 
+		// Which faces of triangles are discarded before rasterization.
+		enum class CullMode { None, Front, Back };
+
+		// The order in which the vertices of front faces appear on screen.
+		enum class Winding { CounterClockwise, Clockwise };
+
+		// When a fragment passes the depth test, comparing its depth with the stored one.
+		enum class DepthFunc { Never, Less, Equal, LEqual, Greater, NotEqual, GEqual, Always };
+
+		// What blending scales the fragment's colour (the source) and the stored colour (the
+		// destination) by. Color factors apply per channel; for alpha they are the alpha factors.
+		// Constant ones take the blend colour.
+		enum class BlendFactor {
+			Zero, One, SrcColor, OneMinusSrcColor, DstColor, OneMinusDstColor,
+			SrcAlpha, OneMinusSrcAlpha, DstAlpha, OneMinusDstAlpha,
+			ConstantColor, OneMinusConstantColor, ConstantAlpha, OneMinusConstantAlpha
+		};
+
+		// How the scaled colours are combined: their sum, either difference, or the smaller or
+		// larger of the two unscaled.
+		enum class BlendEquation { Add, Subtract, ReverseSubtract, Min, Max };
+
 		struct Object {
 			GLuint vao;
 			int nTris;
 		};
 
+		// How textures are filtered: taking the nearest texel, blending the four nearest, or also
+		// blending between the two nearest mipmap levels. The first two use the nearest level.
+		enum class TextureFilter { Nearest, Bilinear, Trilinear };
+
+		// How texture coordinates outside [0, 1] are brought back into the texture.
+		enum class TextureWrap { Repeat, MirroredRepeat, ClampToEdge };
+
+		struct Texture {
+			GLuint id;
+		};
+
 #include "api.hpp"
 
 	}
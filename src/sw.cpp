@@ -1,14 +1,117 @@
 #include "sw.hpp"
 
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+
+// Counts samples and records trace events in the inner loops; build with
+// SW_PIPELINE_STATS=0 to leave them out.
+#ifndef SW_PIPELINE_STATS
+#define SW_PIPELINE_STATS 1
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SW_X86 1
+#endif
 
 namespace COL781
 {
 	namespace Software
 	{
 
+		// sub-sample precision of the fixed point vertex positions
+		const int subPixelBits = 4;
+		const int subPixelOne = 1 << subPixelBits;
+		// vertices further out than this (in samples) can't be represented, see setupTriangle
+		const float maxCoordinate = 1 << 22;
+
+		// Colours are only converted from packed RGBA8 (see packColor) to the format
+		// of the framebuffer surface when the frame is resolved.
+		inline Uint32 channel(Uint32 rgba, int k)
+		{
+			return (rgba >> (8 * k)) & 0xFF;
+		}
+
+		// Same as SDL_MapRGBA for formats that aren't palettized.
+		inline Uint32 toSurfaceFormat(Uint32 r, Uint32 g, Uint32 b, Uint32 a, const SDL_PixelFormat *format)
+		{
+			return (r >> format->Rloss) << format->Rshift
+				| (g >> format->Gloss) << format->Gshift
+				| (b >> format->Bloss) << format->Bshift
+				| (((a >> format->Aloss) << format->Ashift) & format->Amask);
+		}
+
+		inline Uint32 toSurfaceFormat(Uint32 rgba, const SDL_PixelFormat *format)
+		{
+			return toSurfaceFormat(channel(rgba, 0), channel(rgba, 1), channel(rgba, 2), channel(rgba, 3), format);
+		}
+
+		// Depth formats. Kernels compare depths as floats: those of the integer formats
+		// are the stored integers, which floats hold exactly.
+		struct DepthD16 {
+			typedef Uint16 Type;
+			static constexpr float scale = 65535.0f;
+		};
+
+		struct DepthD24 {
+			typedef Uint32 Type;
+			static constexpr float scale = 16777215.0f;
+		};
+
+		struct DepthD32F {
+			typedef float Type;
+			static constexpr float scale = 0.0f;
+		};
+
+		// The stored form of depth z, clamped to [0, 1].
+		template <typename Depth>
+		inline float encodeDepth(float z)
+		{
+			z = std::min(std::max(z, 0.0f), 1.0f);
+			return Depth::scale ? (float)(Sint32)(z * Depth::scale + 0.5f) : z;
+		}
+
+		inline float encodeDepth(DepthFormat format, float z)
+		{
+			switch (format)
+			{
+			case DepthFormat::D16: return encodeDepth<DepthD16>(z);
+			case DepthFormat::D24: return encodeDepth<DepthD24>(z);
+			default: return encodeDepth<DepthD32F>(z);
+			}
+		}
+
+		// Which orderings of a fragment's depth against the stored depth pass the test.
+		struct DepthCompare {
+			bool less, equal, greater;
+		};
+
+		inline DepthCompare depthCompare(DepthFunc func)
+		{
+			switch (func)
+			{
+			case DepthFunc::Never: return {false, false, false};
+			case DepthFunc::Less: return {true, false, false};
+			case DepthFunc::Equal: return {false, true, false};
+			case DepthFunc::LEqual: return {true, true, false};
+			case DepthFunc::Greater: return {false, false, true};
+			case DepthFunc::NotEqual: return {true, false, true};
+			case DepthFunc::GEqual: return {false, true, true};
+			default: return {true, true, true};
+			}
+		}
+
+		inline bool depthPasses(const DepthCompare &c, float z, float stored)
+		{
+			return (c.less && z < stored) || (c.equal && z == stored) || (c.greater && z > stored);
+		}
+
 		// Forward declarations
 
 		template <>
@@ -19,6 +122,8 @@ namespace COL781
 		glm::vec3 Attribs::get(int index) const;
 		template <>
 		glm::vec4 Attribs::get(int index) const;
+		template <>
+		glm::mat4 Attribs::get(int index) const;
 
 		template <>
 		void Attribs::set(int index, float value);
@@ -31,6 +136,10 @@ namespace COL781
 
 		// Built-in shaders
 
+		const int transformLocation = Uniforms::location("transform");
+		const int colorLocation = Uniforms::location("color");
+		const int textureLocation = Uniforms::location("tex");
+
 		VertexShader Rasterizer::vsIdentity()
 		{
 			return [](const Uniforms &uniforms, const Attribs &in, Attribs &out)
@@ -45,7 +154,7 @@ namespace COL781
 			return [](const Uniforms &uniforms, const Attribs &in, Attribs &out)
 			{
 				glm::vec4 vertex = in.get<glm::vec4>(0);
-				glm::mat4 transform = uniforms.get<glm::mat4>("transform");
+				glm::mat4 transform = uniforms.get<glm::mat4>(transformLocation);
 				return transform * vertex;
 			};
 		}
@@ -68,16 +177,29 @@ namespace COL781
 				glm::vec4 vertex = in.get<glm::vec4>(0);
 				glm::vec4 color = in.get<glm::vec4>(1);
 				out.set<glm::vec4>(0, color);
-				glm::mat4 transform = uniforms.get<glm::mat4>("transform");
+				glm::mat4 transform = uniforms.get<glm::mat4>(transformLocation);
 				return transform * vertex;
 			};
 		}
 
+		VertexShader Rasterizer::vsColorTransformInstanced()
+		{
+			return [](const Uniforms &uniforms, const Attribs &in, Attribs &out)
+			{
+				glm::vec4 vertex = in.get<glm::vec4>(0);
+				glm::vec4 color = in.get<glm::vec4>(1);
+				out.set<glm::vec4>(0, color);
+				glm::mat4 transform = uniforms.get<glm::mat4>(transformLocation);
+				glm::mat4 instanceTransform = in.get<glm::mat4>(2);
+				return transform * (instanceTransform * vertex);
+			};
+		}
+
 		FragmentShader Rasterizer::fsConstant()
 		{
 			return [](const Uniforms &uniforms, const Attribs &in)
 			{
-				glm::vec4 color = uniforms.get<glm::vec4>("color");
+				glm::vec4 color = uniforms.get<glm::vec4>(colorLocation);
 				return color;
 			};
 		}
@@ -91,8 +213,39 @@ namespace COL781
 			};
 		}
 
+		VertexShader Rasterizer::vsTextureTransform()
+		{
+			return [](const Uniforms &uniforms, const Attribs &in, Attribs &out)
+			{
+				glm::vec4 vertex = in.get<glm::vec4>(0);
+				glm::vec2 texCoord = in.get<glm::vec2>(1);
+				out.set<glm::vec2>(0, texCoord);
+				glm::mat4 transform = uniforms.get<glm::mat4>(transformLocation);
+				return transform * vertex;
+			};
+		}
+
+		FragmentShader Rasterizer::fsTexture()
+		{
+			return [](const Uniforms &uniforms, const Attribs &in)
+			{
+				const Texture *texture = uniforms.get<const Texture *>(textureLocation);
+				return texture->sample(in, 0);
+			};
+		}
+
 		// Implementation of Attribs and Uniforms classes
 
+		bool checkIndex(int index)
+		{
+			if (index < 0 || index >= Attribs::capacity)
+			{
+				std::cout << "Warning: attribute " << index << " is out of range, at most " << Attribs::capacity << " are allowed" << std::endl;
+				return false;
+			}
+			return true;
+		}
+
 		void checkDimension(int index, int actual, int requested)
 		{
 			if (actual != requested)
@@ -104,6 +257,8 @@ namespace COL781
 		template <>
 		float Attribs::get(int index) const
 		{
+			if (!checkIndex(index))
+				return 0;
 			checkDimension(index, dims[index], 1);
 			return values[index].x;
 		}
@@ -111,6 +266,8 @@ namespace COL781
 		template <>
 		glm::vec2 Attribs::get(int index) const
 		{
+			if (!checkIndex(index))
+				return glm::vec2(0);
 			checkDimension(index, dims[index], 2);
 			return glm::vec2(values[index].x, values[index].y);
 		}
@@ -118,6 +275,8 @@ namespace COL781
 		template <>
 		glm::vec3 Attribs::get(int index) const
 		{
+			if (!checkIndex(index))
+				return glm::vec3(0);
 			checkDimension(index, dims[index], 3);
 			return glm::vec3(values[index].x, values[index].y, values[index].z);
 		}
@@ -125,22 +284,29 @@ namespace COL781
 		template <>
 		glm::vec4 Attribs::get(int index) const
 		{
+			if (!checkIndex(index))
+				return glm::vec4(0);
 			checkDimension(index, dims[index], 4);
 			return values[index];
 		}
 
-		void expand(std::vector<int> &dims, std::vector<glm::vec4> &values, int index)
+		template <>
+		glm::mat4 Attribs::get(int index) const
 		{
-			if (dims.size() < index + 1)
-				dims.resize(index + 1);
-			if (values.size() < index + 1)
-				values.resize(index + 1);
+			if (!checkIndex(index) || !checkIndex(index + 3))
+				return glm::mat4(0.0f);
+			for (int k = 0; k < 4; k++)
+			{
+				checkDimension(index + k, dims[index + k], 4);
+			}
+			return glm::mat4(values[index], values[index + 1], values[index + 2], values[index + 3]);
 		}
 
 		template <>
 		void Attribs::set(int index, float value)
 		{
-			expand(dims, values, index);
+			if (!checkIndex(index))
+				return;
 			dims[index] = 1;
 			values[index].x = value;
 		}
@@ -148,7 +314,8 @@ namespace COL781
 		template <>
 		void Attribs::set(int index, glm::vec2 value)
 		{
-			expand(dims, values, index);
+			if (!checkIndex(index))
+				return;
 			dims[index] = 2;
 			values[index].x = value.x;
 			values[index].y = value.y;
@@ -157,7 +324,8 @@ namespace COL781
 		template <>
 		void Attribs::set(int index, glm::vec3 value)
 		{
-			expand(dims, values, index);
+			if (!checkIndex(index))
+				return;
 			dims[index] = 3;
 			values[index].x = value.x;
 			values[index].y = value.y;
@@ -167,35 +335,427 @@ namespace COL781
 		template <>
 		void Attribs::set(int index, glm::vec4 value)
 		{
-			expand(dims, values, index);
+			if (!checkIndex(index))
+				return;
 			dims[index] = 4;
 			values[index] = value;
 		}
 
-		template <typename T>
-		T Uniforms::get(const std::string &name) const
+		void Attribs::load(int index, int dim, const float *value)
 		{
-			return *(T *)values.at(name);
+			if (!checkIndex(index))
+				return;
+			dims[index] = dim;
+			for (int k = 0; k < dim; k++)
+			{
+				values[index][k] = value[k];
+			}
 		}
 
-		template <typename T>
-		void Uniforms::set(const std::string &name, T value)
+		// The names given locations, in order. Names are only added, under the mutex, and
+		// each is written before the count that covers it, so lookups need no lock.
+		struct UniformNames {
+			static const int capacity = 1024;
+			std::mutex mutex;
+			std::atomic<int> count{0};
+			std::string names[capacity];
+		};
+
+		static UniformNames &uniformNames()
+		{
+			static UniformNames names;
+			return names;
+		}
+
+		int Uniforms::location(const std::string &name)
+		{
+			int location = find(name);
+			if (location >= 0)
+			{
+				return location;
+			}
+			UniformNames &table = uniformNames();
+			std::lock_guard<std::mutex> lock(table.mutex);
+			location = table.count.load(std::memory_order_relaxed);
+			for (int i = 0; i < location; i++)
+			{
+				if (table.names[i] == name)
+				{
+					return i;
+				}
+			}
+			if (location == UniformNames::capacity)
+			{
+				throw std::length_error("too many uniform names");
+			}
+			table.names[location] = name;
+			table.count.store(location + 1, std::memory_order_release);
+			return location;
+		}
+
+		int Uniforms::find(const std::string &name)
+		{
+			const UniformNames &table = uniformNames();
+			int count = table.count.load(std::memory_order_acquire);
+			for (int i = 0; i < count; i++)
+			{
+				if (table.names[i] == name)
+				{
+					return i;
+				}
+			}
+			return -1;
+		}
+
+		void Uniforms::clear()
+		{
+			slots.clear();
+			block.clear();
+		}
+
+		// Implementation of the Texture class
+
+		// Where texel (x, y) of a level is stored: in 4x4 tiles in rows from the bottom up, and in
+		// Morton order within a tile, so that the four texels blended by a bilinear sample are
+		// in one tile, or in two or four neighbouring ones.
+		inline size_t texelIndex(int x, int y, int tilesX)
+		{
+			int morton = (x & 1) | (y & 1) << 1 | (x & 2) << 1 | (y & 2) << 2;
+			return ((size_t)(y >> 2) * tilesX + (x >> 2)) * 16 + morton;
+		}
+
+		// Brings texel coordinate i back into [0, n).
+		inline int wrapTexel(int i, int n, TextureWrap wrap)
+		{
+			switch (wrap)
+			{
+			case TextureWrap::Repeat:
+				i %= n;
+				return i < 0 ? i + n : i;
+			case TextureWrap::MirroredRepeat:
+				i %= 2 * n;
+				i = i < 0 ? i + 2 * n : i;
+				return i < n ? i : 2 * n - 1 - i;
+			default:
+				return std::min(std::max(i, 0), n - 1);
+			}
+		}
+
+		inline glm::vec4 unpackColor(Uint32 rgba)
+		{
+			return glm::vec4(channel(rgba, 0), channel(rgba, 1), channel(rgba, 2), channel(rgba, 3)) * (1 / 255.0f);
+		}
+
+		// Sum of four packed colours with weights w, as floats in [0, 1].
+		inline glm::vec4 blendTexels(const Uint32 t[4], const float w[4])
+		{
+#ifdef SW_X86
+			// one texel per register, with a channel in each lane
+			__m128i texels = _mm_loadu_si128((const __m128i *)t);
+			__m128i zero = _mm_setzero_si128();
+			__m128i t01 = _mm_unpacklo_epi8(texels, zero), t23 = _mm_unpackhi_epi8(texels, zero);
+			__m128 c0 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(t01, zero));
+			__m128 c1 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(t01, zero));
+			__m128 c2 = _mm_cvtepi32_ps(_mm_unpacklo_epi16(t23, zero));
+			__m128 c3 = _mm_cvtepi32_ps(_mm_unpackhi_epi16(t23, zero));
+			__m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(c0, _mm_set1_ps(w[0])), _mm_mul_ps(c1, _mm_set1_ps(w[1]))),
+				_mm_add_ps(_mm_mul_ps(c2, _mm_set1_ps(w[2])), _mm_mul_ps(c3, _mm_set1_ps(w[3]))));
+			float color[4];
+			_mm_storeu_ps(color, _mm_mul_ps(sum, _mm_set1_ps(1 / 255.0f)));
+			return glm::vec4(color[0], color[1], color[2], color[3]);
+#else
+			glm::vec4 color;
+			for (int k = 0; k < 4; k++)
+			{
+				color[k] = ((channel(t[0], k) * w[0] + channel(t[1], k) * w[1]) + (channel(t[2], k) * w[2] + channel(t[3], k) * w[3])) * (1 / 255.0f);
+			}
+			return color;
+#endif
+		}
+
+		// coordinates are clamped to this many texels either way before they are converted to integers
+		const float maxTexelCoordinate = 1 << 24;
+
+		// Splits n * scale - offset for each of 4 lanes into its floor and the fraction above it.
+		inline void texelCoordinates(const float n[4], float scale, float offset, int floor[4], float fraction[4])
+		{
+#ifdef SW_X86
+			__m128 c = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(n), _mm_set1_ps(scale)), _mm_set1_ps(offset));
+			c = _mm_min_ps(_mm_max_ps(c, _mm_set1_ps(-maxTexelCoordinate)), _mm_set1_ps(maxTexelCoordinate));
+			// truncation rounds negative coordinates up; take one off those
+			__m128i i = _mm_cvttps_epi32(c);
+			__m128 f = _mm_cvtepi32_ps(i);
+			__m128 above = _mm_cmpgt_ps(f, c);
+			i = _mm_add_epi32(i, _mm_castps_si128(above));
+			f = _mm_sub_ps(f, _mm_and_ps(above, _mm_set1_ps(1.0f)));
+			_mm_storeu_si128((__m128i *)floor, i);
+			_mm_storeu_ps(fraction, _mm_sub_ps(c, f));
+#else
+			for (int lane = 0; lane < 4; lane++)
+			{
+				// same steps as the SSE version, so that both give the same results
+				float c = n[lane] * scale - offset;
+				c = c > -maxTexelCoordinate ? c : -maxTexelCoordinate;
+				c = c < maxTexelCoordinate ? c : maxTexelCoordinate;
+				int i = (int)c;
+				float f = (float)i;
+				if (f > c)
+				{
+					i--;
+					f -= 1.0f;
+				}
+				floor[lane] = i;
+				fraction[lane] = c - f;
+			}
+#endif
+		}
+
+		void Texture::Level::resize(int w, int h)
+		{
+			width = w;
+			height = h;
+			tilesX = (w + 3) / 4;
+			texels.assign((size_t)tilesX * ((h + 3) / 4) * 16, 0);
+		}
+
+		float Texture::lod(glm::vec2 dx, glm::vec2 dy) const
+		{
+			// the longer of the two steps, in texels
+			float w = levels[0].width, h = levels[0].height;
+			float lx = dx.x * w * dx.x * w + dx.y * h * dx.y * h;
+			float ly = dy.x * w * dy.x * w + dy.y * h * dy.y * h;
+			return 0.5f * std::log2(std::max(lx, ly));
+		}
+
+		void Texture::filterLevel(int index, bool linear, const float u[4], const float v[4], int n, glm::vec4 *out) const
+		{
+			const Level &level = levels[index];
+			// texel coordinates of the points; linear filtering blends the texels whose
+			// centres are around each, from the one below and to the left
+			int x[4], y[4];
+			float fx[4], fy[4];
+			float offset = linear ? 0.5f : 0.0f;
+			texelCoordinates(u, level.width, offset, x, fx);
+			texelCoordinates(v, level.height, offset, y, fy);
+			for (int lane = 0; lane < n; lane++)
+			{
+				if (!linear)
+				{
+					int i = wrapTexel(x[lane], level.width, wrap), j = wrapTexel(y[lane], level.height, wrap);
+					out[lane] = unpackColor(level.texels[texelIndex(i, j, level.tilesX)]);
+					continue;
+				}
+				int i0 = wrapTexel(x[lane], level.width, wrap), i1 = wrapTexel(x[lane] + 1, level.width, wrap);
+				int j0 = wrapTexel(y[lane], level.height, wrap), j1 = wrapTexel(y[lane] + 1, level.height, wrap);
+				Uint32 t[4] = {
+					level.texels[texelIndex(i0, j0, level.tilesX)], level.texels[texelIndex(i1, j0, level.tilesX)],
+					level.texels[texelIndex(i0, j1, level.tilesX)], level.texels[texelIndex(i1, j1, level.tilesX)]};
+				float a = fx[lane], b = fy[lane];
+				float w[4] = {(1 - a) * (1 - b), a * (1 - b), (1 - a) * b, a * b};
+				out[lane] = blendTexels(t, w);
+			}
+		}
+
+		void Texture::sample(const float u[4], const float v[4], int n, float lod, glm::vec4 *out) const
+		{
+			if (levels.empty())
+			{
+				// like an incomplete texture in OpenGL
+				std::fill(out, out + n, glm::vec4(0, 0, 0, 1));
+				return;
+			}
+			int last = levels.size() - 1;
+			lod = std::min(lod, (float)last);
+			if (filter == TextureFilter::Trilinear && lod > 0)
+			{
+				int level = (int)lod;
+				float t = lod - level;
+				filterLevel(level, true, u, v, n, out);
+				if (t > 0)
+				{
+					glm::vec4 next[4];
+					filterLevel(level + 1, true, u, v, n, next);
+					for (int lane = 0; lane < n; lane++)
+					{
+						out[lane] = out[lane] + (next[lane] - out[lane]) * t;
+					}
+				}
+				return;
+			}
+			// magnified textures take level 0, minified ones the level nearest to lod
+			int level = lod > 0.5f ? (int)std::ceil(lod + 0.5f) - 1 : 0;
+			filterLevel(level, filter != TextureFilter::Nearest, u, v, n, out);
+		}
+
+		glm::vec4 Texture::sample(glm::vec2 uv, glm::vec2 dx, glm::vec2 dy) const
+		{
+			float u[4] = {uv.x}, v[4] = {uv.y};
+			glm::vec4 color;
+			sample(u, v, 1, levels.empty() ? 0 : lod(dx, dy), &color);
+			return color;
+		}
+
+		glm::vec4 Texture::sample(const Attribs &in, int attribIndex) const
+		{
+			glm::vec2 uv = in.get<glm::vec2>(attribIndex);
+			if (in.quad == NULL)
+			{
+				return sample(uv, glm::vec2(0), glm::vec2(0));
+			}
+			// coarse derivatives, the same for the whole quad
+			glm::vec2 uv0 = in.quad[0].get<glm::vec2>(attribIndex);
+			glm::vec2 dx = in.quad[1].get<glm::vec2>(attribIndex) - uv0;
+			glm::vec2 dy = in.quad[2].get<glm::vec2>(attribIndex) - uv0;
+			return sample(uv, dx, dy);
+		}
+
+		void Texture::sample(const FragmentQuad &quad, int attribIndex, glm::vec4 out[4]) const
+		{
+			float u[4], v[4];
+			for (int lane = 0; lane < 4; lane++)
+			{
+				glm::vec2 uv = quad.in[lane].get<glm::vec2>(attribIndex);
+				u[lane] = uv.x;
+				v[lane] = uv.y;
+			}
+			glm::vec2 dx(u[1] - u[0], v[1] - v[0]), dy(u[2] - u[0], v[2] - v[0]);
+			sample(u, v, 4, levels.empty() ? 0 : lod(dx, dy), out);
+		}
+
+		FrameStats &FrameStats::operator+=(const FrameStats &other)
+		{
+			primitivesSubmitted += other.primitivesSubmitted;
+			verticesShaded += other.verticesShaded;
+			fragmentsShaded += other.fragmentsShaded;
+			primitivesClipped += other.primitivesClipped;
+			primitivesCulled += other.primitivesCulled;
+			facesCulled += other.facesCulled;
+			degenerateCulled += other.degenerateCulled;
+			vertexMilliseconds += other.vertexMilliseconds;
+			setupMilliseconds += other.setupMilliseconds;
+			rasterMilliseconds += other.rasterMilliseconds;
+			resolveMilliseconds += other.resolveMilliseconds;
+			hizTilesRejected += other.hizTilesRejected;
+			hizBlocksRejected += other.hizBlocksRejected;
+			hizSamplesRejected += other.hizSamplesRejected;
+			samplesTested += other.samplesTested;
+			samplesDepthRejected += other.samplesDepthRejected;
+			samplesWritten += other.samplesWritten;
+			return *this;
+		}
+
+		// Implementation of WorkerPool
+
+		WorkerPool::WorkerPool(int nThreads) : next(0)
+		{
+			for (int i = 1; i < nThreads; i++)
+			{
+				threads.push_back(std::thread(&WorkerPool::work, this, i));
+			}
+		}
+
+		WorkerPool::~WorkerPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			wake.notify_all();
+			for (std::thread &t : threads)
+			{
+				t.join();
+			}
+		}
+
+		int WorkerPool::size() const
+		{
+			return threads.size() + 1;
+		}
+
+		void WorkerPool::run(int n, const std::function<void(int)> &task)
+		{
+			if (threads.empty() || n <= 1)
+			{
+				for (int i = 0; i < n; i++)
+				{
+					task(i);
+				}
+				return;
+			}
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				this->task = &task;
+				count = n;
+				next = 0;
+				busy = threads.size();
+				generation++;
+			}
+			wake.notify_all();
+			drain();
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [this] { return busy == 0; });
+			// a task that threw on any thread throws here, on the caller's
+			if (error)
+			{
+				std::exception_ptr thrown = error;
+				error = NULL;
+				std::rethrow_exception(thrown);
+			}
+		}
+
+		void WorkerPool::drain()
 		{
-			auto it = values.find(name);
-			if (it != values.end())
+			int i;
+			while ((i = next++) < count)
 			{
-				// delete it->second;
+				try
+				{
+					(*task)(i);
+				}
+				catch (...)
+				{
+					// the first exception is kept for run() to rethrow, and the tasks not
+					// started yet are skipped
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!error)
+					{
+						error = std::current_exception();
+					}
+					next = count;
+				}
 			}
-			values[name] = (void *)(new T(value));
 		}
 
-		Uniforms::~Uniforms()
+		// see WorkerPool::currentThread
+		thread_local int workerIndex = 0;
+
+		int WorkerPool::currentThread()
 		{
-			// can't do this, because void*
+			return workerIndex;
+		}
 
-			// for(auto& [name,pointers] : values){
-			// 	delete pointers;
-			// }
+		void WorkerPool::work(int index)
+		{
+			workerIndex = index;
+			unsigned seen = 0;
+			while (true)
+			{
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					wake.wait(lock, [this, &seen] { return stopping || generation != seen; });
+					if (stopping)
+					{
+						return;
+					}
+					seen = generation;
+				}
+				drain();
+				std::lock_guard<std::mutex> lock(mutex);
+				if (--busy == 0)
+				{
+					done.notify_one();
+				}
+			}
 		}
 
 		bool Rasterizer::initialize(const std::string &title, int width, int height, int spp)
@@ -214,20 +774,115 @@ namespace COL781
 				else
 				{
 					windowSurface = SDL_GetWindowSurface(window);
-					framebuffer = SDL_CreateRGBSurface(0, width, height, 32, 0, 0, 0, 0);
 				}
 			}
+			return createBuffers(width, height, spp);
+		}
+
+		Rasterizer::~Rasterizer()
+		{
+			// joins the worker threads
+			delete workers;
+			delete[] pbuffer;
+			delete[] zbuffer;
+			SDL_FreeSurface(framebuffer);
+			if (window != NULL)
+			{
+				// the window surface belongs to the window
+				SDL_DestroyWindow(window);
+				SDL_Quit();
+			}
+		}
+
+		bool Rasterizer::initializeOffscreen(int width, int height, int spp)
+		{
+			// surfaces don't need SDL_Init, so no video subsystem is touched
+			window = NULL;
+			windowSurface = NULL;
+			return createBuffers(width, height, spp);
+		}
+
+		bool Rasterizer::createBuffers(int width, int height, int spp)
+		{
+			SDL_FreeSurface(framebuffer);
+			framebuffer = SDL_CreateRGBSurface(0, width, height, 32, 0, 0, 0, 0);
+			if (framebuffer == NULL)
+			{
+				return false;
+			}
 			// samples per axis
 			supersampling = std::max(round(sqrt(spp)), 1.0);
 			frameHeight = height;
 			frameWidth = width;
 			scaledHeight = supersampling * height;
 			scaledWidth = supersampling * width;
-			pbuffer = new Uint32[scaledHeight * scaledWidth];
-			zbuffer = new float[scaledHeight * scaledWidth];
+			tilesX = (scaledWidth + tileSize - 1) / tileSize;
+			tilesY = (scaledHeight + tileSize - 1) / tileSize;
+			bins.resize(tilesX * tilesY);
+			tileStats.resize(tilesX * tilesY);
+			blocksX = (scaledWidth + blockSize - 1) / blockSize;
+			blocksY = (scaledHeight + blockSize - 1) / blockSize;
+			blockDepth.resize(blocksX * blocksY);
+			tileDepth.resize(tilesX * tilesY);
+			tileColorCleared.resize(tilesX * tilesY);
+			tileDepthCleared.resize(tilesX * tilesY);
+			compression = supersampling > 1 && blockSize % supersampling == 0;
+			compressed.assign(compression ? width * height : 0, false);
+			allocateSampleBuffers();
+			updateSamplePattern();
+			setThreadCount(threadCount);
 			return true;
 		}
 
+		void Rasterizer::allocateSampleBuffers()
+		{
+			delete[] pbuffer;
+			delete[] zbuffer;
+			// the tiled layout needs pixels that don't straddle blocks, like compression
+			tiled = bufferLayout == BufferLayout::Tiled && blockSize % supersampling == 0;
+			if (tiled)
+			{
+				// whole tiles, including the parts past the edges of the screen
+				sampleCount = (size_t)tilesX * tilesY * tileSize * tileSize;
+				sampleRowStride = blockSize;
+			}
+			else
+			{
+				sampleCount = (size_t)scaledWidth * scaledHeight;
+				sampleRowStride = -scaledWidth;
+			}
+			pbuffer = new Uint32[sampleCount];
+			zbuffer = new Uint8[sampleCount * (depthFormat == DepthFormat::D16 ? sizeof(Uint16) : sizeof(Uint32))];
+			// the new buffers hold nothing, so every tile takes the last clear values, and
+			// the coarse depths are those of the clear in the (maybe new) depth format
+			std::fill(tileColorCleared.begin(), tileColorCleared.end(), true);
+			std::fill(tileDepthCleared.begin(), tileDepthCleared.end(), true);
+			float stored = encodeDepth(depthFormat, clearDepthValue);
+			std::fill(blockDepth.begin(), blockDepth.end(), stored);
+			std::fill(tileDepth.begin(), tileDepth.end(), stored);
+		}
+
+		void Rasterizer::updateSamplePattern()
+		{
+			int s = supersampling;
+			sampleOffsetX.assign(s, 0);
+			sampleOffsetY.assign(s, 0);
+			sampleOffsetBound = 0;
+			if (samplePattern != SamplePattern::RotatedGrid)
+			{
+				return;
+			}
+			// Sample (u, v) of the pixel goes to ((s*u + v + 1/2) / s^2, (s*v + s-1-u + 1/2) / s^2)
+			// in pixel units, so every sample has a row and a column of the s^2 x s^2 grid to itself.
+			// Offsets are rounded to the fixed point grid.
+			for (int n = 0; n < s; n++)
+			{
+				sampleOffsetX[n] = lround(((n + 0.5) / s - 0.5) * subPixelOne);
+				sampleOffsetY[n] = lround(((s - 1 - n + 0.5) / s - 0.5) * subPixelOne);
+				sampleOffsetBound = std::max(sampleOffsetBound, std::abs(sampleOffsetX[n]));
+			}
+		}
+
 		bool Rasterizer::shouldQuit()
 		{
 			return this->quit;
@@ -274,8 +929,6 @@ namespace COL781
 		void Rasterizer::setUniform(ShaderProgram &program, const std::string &name, glm::vec4 value)
 		{
 			program.uniforms.set<glm::vec4>(name, value);
-			// std::cout << "Set "<< name << std::endl;
-			// program.
 		}
 
 		template <>
@@ -296,249 +949,1897 @@ namespace COL781
 			program.uniforms.set<glm::mat4>(name, value);
 		}
 
-		void Rasterizer::deleteShaderProgram(ShaderProgram &program)
+		int Rasterizer::getUniformLocation(ShaderProgram &, const std::string &name)
 		{
-			// TODO: nothing here?
-			// destructor will get called in programs.uniforms
+			return Uniforms::location(name);
 		}
 
-		Object Rasterizer::createObject()
+		template <>
+		void Rasterizer::setUniform(ShaderProgram &program, int location, float value)
 		{
-			return Object();
+			program.uniforms.set<float>(location, value);
 		}
 
-		void fillAttribs(Object &object, int n)
+		template <>
+		void Rasterizer::setUniform(ShaderProgram &program, int location, int value)
 		{
-			while (n > object.attribs.size())
-			{
-				object.attribs.push_back(Attribs());
-			}
+			program.uniforms.set<int>(location, value);
 		}
 
 		template <>
-		void Rasterizer::setVertexAttribs(Object &object, int attribIndex, int n, const float *data)
+		void Rasterizer::setUniform(ShaderProgram &program, int location, glm::vec2 value)
 		{
-			fillAttribs(object, n);
-			for (size_t i = 0; i < n; i++)
-			{
-				object.attribs[i].set<float>(attribIndex, data[i]);
-			}
+			program.uniforms.set<glm::vec2>(location, value);
 		}
 
 		template <>
-		void Rasterizer::setVertexAttribs(Object &object, int attribIndex, int n, const glm::vec2 *data)
+		void Rasterizer::setUniform(ShaderProgram &program, int location, glm::vec3 value)
 		{
-			fillAttribs(object, n);
-			for (size_t i = 0; i < n; i++)
-			{
-				object.attribs[i].set<glm::vec2>(attribIndex, data[i]);
-			}
+			program.uniforms.set<glm::vec3>(location, value);
 		}
 
 		template <>
-		void Rasterizer::setVertexAttribs(Object &object, int attribIndex, int n, const glm::vec3 *data)
+		void Rasterizer::setUniform(ShaderProgram &program, int location, glm::vec4 value)
 		{
-			fillAttribs(object, n);
-			for (size_t i = 0; i < n; i++)
-			{
-				object.attribs[i].set<glm::vec3>(attribIndex, data[i]);
-			}
+			program.uniforms.set<glm::vec4>(location, value);
 		}
 
 		template <>
-		void Rasterizer::setVertexAttribs(Object &object, int attribIndex, int n, const glm::vec4 *data)
+		void Rasterizer::setUniform(ShaderProgram &program, int location, glm::mat2 value)
 		{
-			fillAttribs(object, n);
-			for (size_t i = 0; i < n; i++)
-			{
-				object.attribs[i].set<glm::vec4>(attribIndex, data[i]);
-			}
+			program.uniforms.set<glm::mat2>(location, value);
 		}
 
-		void Rasterizer::setTriangleIndices(Object &object, int n, glm::ivec3 *indices)
+		template <>
+		void Rasterizer::setUniform(ShaderProgram &program, int location, glm::mat3 value)
+		{
+			program.uniforms.set<glm::mat3>(location, value);
+		}
+
+		template <>
+		void Rasterizer::setUniform(ShaderProgram &program, int location, glm::mat4 value)
+		{
+			program.uniforms.set<glm::mat4>(location, value);
+		}
+
+		void Rasterizer::deleteShaderProgram(ShaderProgram &program)
+		{
+			// TODO: nothing here?
+			// destructor will get called in programs.uniforms
+		}
+
+		Object Rasterizer::createObject()
+		{
+			return Object();
+		}
+
+		void setAttribs(Object &object, int attribIndex, int n, int d, const float *data, bool perInstance = false)
+		{
+			if ((int)object.attribs.size() < attribIndex + 1)
+			{
+				object.attribs.resize(attribIndex + 1);
+			}
+			AttribArray &array = object.attribs[attribIndex];
+			array.dim = d;
+			array.count = n;
+			array.perInstance = perInstance;
+			array.data.assign(data, data + n * d);
+			if (!perInstance)
+			{
+				object.nVertices = std::max(object.nVertices, n);
+			}
+		}
+
+		template <>
+		void Rasterizer::setVertexAttribs(Object &object, int attribIndex, int n, const float *data)
+		{
+			setAttribs(object, attribIndex, n, 1, data);
+		}
+
+		template <>
+		void Rasterizer::setVertexAttribs(Object &object, int attribIndex, int n, const glm::vec2 *data)
+		{
+			setAttribs(object, attribIndex, n, 2, (const float *)data);
+		}
+
+		template <>
+		void Rasterizer::setVertexAttribs(Object &object, int attribIndex, int n, const glm::vec3 *data)
+		{
+			setAttribs(object, attribIndex, n, 3, (const float *)data);
+		}
+
+		template <>
+		void Rasterizer::setVertexAttribs(Object &object, int attribIndex, int n, const glm::vec4 *data)
+		{
+			setAttribs(object, attribIndex, n, 4, (const float *)data);
+		}
+
+		void Rasterizer::setTriangleIndices(Object &object, int n, glm::ivec3 *indices)
 		{
 			object.indices = std::vector<glm::ivec3>(indices, indices + n);
 		}
 
-		void Rasterizer::enableDepthTest()
+		template <>
+		void Rasterizer::setInstanceAttribs(Object &object, int attribIndex, int n, const float *data)
+		{
+			setAttribs(object, attribIndex, n, 1, data, true);
+		}
+
+		template <>
+		void Rasterizer::setInstanceAttribs(Object &object, int attribIndex, int n, const glm::vec2 *data)
+		{
+			setAttribs(object, attribIndex, n, 2, (const float *)data, true);
+		}
+
+		template <>
+		void Rasterizer::setInstanceAttribs(Object &object, int attribIndex, int n, const glm::vec3 *data)
+		{
+			setAttribs(object, attribIndex, n, 3, (const float *)data, true);
+		}
+
+		template <>
+		void Rasterizer::setInstanceAttribs(Object &object, int attribIndex, int n, const glm::vec4 *data)
+		{
+			setAttribs(object, attribIndex, n, 4, (const float *)data, true);
+		}
+
+		template <>
+		void Rasterizer::setInstanceAttribs(Object &object, int attribIndex, int n, const glm::mat4 *data)
+		{
+			// one attribute per column
+			std::vector<glm::vec4> column(n);
+			for (int c = 0; c < 4; c++)
+			{
+				for (int i = 0; i < n; i++)
+				{
+					column[i] = data[i][c];
+				}
+				setAttribs(object, attribIndex + c, n, 4, (const float *)column.data(), true);
+			}
+		}
+
+		Texture Rasterizer::createTexture()
+		{
+			return Texture();
+		}
+
+		void Rasterizer::setTextureData(Texture &texture, int width, int height, const Uint8 *rgba)
+		{
+			texture.levels.assign(1, Texture::Level());
+			Texture::Level &level = texture.levels[0];
+			level.resize(width, height);
+			for (int y = 0; y < height; y++)
+			{
+				for (int x = 0; x < width; x++)
+				{
+					const Uint8 *texel = rgba + 4 * (x + (size_t)width * y);
+					level.texels[texelIndex(x, y, level.tilesX)] = (Uint32)texel[0] | (Uint32)texel[1] << 8 | (Uint32)texel[2] << 16 | (Uint32)texel[3] << 24;
+				}
+			}
+		}
+
+		void Rasterizer::generateMipmaps(Texture &texture)
+		{
+			if (texture.levels.empty())
+			{
+				return;
+			}
+			texture.levels.resize(1);
+			while (texture.levels.back().width > 1 || texture.levels.back().height > 1)
+			{
+				texture.levels.emplace_back();
+				const Texture::Level &src = texture.levels[texture.levels.size() - 2];
+				Texture::Level &dst = texture.levels.back();
+				dst.resize(std::max(src.width / 2, 1), std::max(src.height / 2, 1));
+				// each texel averages a 2x2 square of the level above, the last row or column
+				// of odd sizes standing in for the one past it
+				for (int y = 0; y < dst.height; y++)
+				{
+					int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+					for (int x = 0; x < dst.width; x++)
+					{
+						int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+						Uint32 t[4] = {
+							src.texels[texelIndex(x0, y0, src.tilesX)], src.texels[texelIndex(x1, y0, src.tilesX)],
+							src.texels[texelIndex(x0, y1, src.tilesX)], src.texels[texelIndex(x1, y1, src.tilesX)]};
+						Uint32 value = 0;
+						for (int k = 0; k < 4; k++)
+						{
+							Uint32 sum = channel(t[0], k) + channel(t[1], k) + channel(t[2], k) + channel(t[3], k);
+							value |= ((sum + 2) / 4) << (8 * k);
+						}
+						dst.texels[texelIndex(x, y, dst.tilesX)] = value;
+					}
+				}
+			}
+		}
+
+		void Rasterizer::setTextureFilter(Texture &texture, TextureFilter filter)
+		{
+			texture.filter = filter;
+		}
+
+		void Rasterizer::setTextureWrap(Texture &texture, TextureWrap wrap)
+		{
+			texture.wrap = wrap;
+		}
+
+		void Rasterizer::setTexture(ShaderProgram &program, const std::string &name, const Texture &texture)
+		{
+			program.uniforms.set<const Texture *>(name, &texture);
+		}
+
+		void Rasterizer::deleteTexture(Texture &texture)
+		{
+			texture.levels.clear();
+			texture.levels.shrink_to_fit();
+		}
+
+		void Rasterizer::enableDepthTest()
+		{
+			if (!depthTesting)
+			{
+				flush();
+			}
+			depthTesting = true;
+		}
+
+		void Rasterizer::setCullMode(CullMode mode)
+		{
+			cullMode = mode;
+		}
+
+		void Rasterizer::setFrontFace(Winding winding)
+		{
+			frontFace = winding;
+		}
+
+		void Rasterizer::setBlending(bool enabled)
+		{
+			blendState.enabled = enabled;
+		}
+
+		void Rasterizer::setBlendFunc(BlendFactor src, BlendFactor dst)
+		{
+			setBlendFunc(src, dst, src, dst);
+		}
+
+		void Rasterizer::setBlendFunc(BlendFactor srcColor, BlendFactor dstColor, BlendFactor srcAlpha, BlendFactor dstAlpha)
+		{
+			blendState.srcColor = srcColor;
+			blendState.dstColor = dstColor;
+			blendState.srcAlpha = srcAlpha;
+			blendState.dstAlpha = dstAlpha;
+		}
+
+		void Rasterizer::setBlendEquation(BlendEquation equation)
+		{
+			setBlendEquation(equation, equation);
+		}
+
+		void Rasterizer::setBlendEquation(BlendEquation color, BlendEquation alpha)
+		{
+			blendState.colorEquation = color;
+			blendState.alphaEquation = alpha;
+		}
+
+		void Rasterizer::setBlendColor(glm::vec4 color)
+		{
+			// clamped like colours stored as unsigned normalized integers
+			blendState.constant = glm::clamp(color, 0.0f, 1.0f);
+		}
+
+		void Rasterizer::setColorMask(bool red, bool green, bool blue, bool alpha)
+		{
+			blendState.writeMask = (red ? 0xFFu : 0) | (green ? 0xFF00u : 0) | (blue ? 0xFF0000u : 0) | (alpha ? 0xFF000000u : 0);
+		}
+
+		void Rasterizer::setDepthMask(bool write)
+		{
+			depthWrite = write;
+		}
+
+		void Rasterizer::setSamplePattern(SamplePattern pattern)
+		{
+			flush();
+			samplePattern = pattern;
+			updateSamplePattern();
+		}
+
+		void Rasterizer::setResolveFilter(ResolveFilter filter)
+		{
+			resolveFilter = filter;
+		}
+
+		void Rasterizer::setBufferLayout(BufferLayout layout)
+		{
+			flush();
+			bufferLayout = layout;
+			allocateSampleBuffers();
+		}
+
+		void Rasterizer::setDepthFormat(DepthFormat format)
+		{
+			flush();
+			depthFormat = format;
+			allocateSampleBuffers();
+		}
+
+		void Rasterizer::setReversedZ(bool reversed)
+		{
+			flush();
+			reversedZ = reversed;
+		}
+
+		void Rasterizer::setDepthFunc(DepthFunc func)
+		{
+			if (func == depthFunc)
+			{
+				return;
+			}
+			flush();
+			// the coarse depths may bound the other direction, or have missed writes, so
+			// they reject nothing until blocks are drawn to or cleared again
+			float unknown = depthCompare(func).greater ? -INFINITY : INFINITY;
+			std::fill(blockDepth.begin(), blockDepth.end(), unknown);
+			std::fill(tileDepth.begin(), tileDepth.end(), unknown);
+			depthFunc = func;
+		}
+
+		void Rasterizer::setThreadCount(int n)
+		{
+			flush();
+			threadCount = n;
+			if (n <= 0)
+			{
+				n = std::max(1u, std::thread::hardware_concurrency());
+			}
+			if (workers != NULL && workers->size() == n)
+			{
+				return;
+			}
+			delete workers;
+			workers = new WorkerPool(n);
+			traceEvents.resize(n);
+		}
+
+		void Rasterizer::setBlockKernel(CoverageKernel kernel)
+		{
+			flush();
+			blockKernel = kernel;
+		}
+
+		void Rasterizer::clear(glm::vec4 color)
+		{
+			clearColor(color);
+			clearDepth(reversedZ ? 0 : 1);
+		}
+
+		void Rasterizer::clearColor(glm::vec4 color)
+		{
+			flush();
+			// argument is normalized; tiles are only filled once they are drawn to
+			clearColorValue = packColor(glm::clamp(color, 0.0f, 1.0f) * 255.0f);
+			std::fill(tileColorCleared.begin(), tileColorCleared.end(), true);
+		}
+
+		void Rasterizer::clearDepth(float depth)
+		{
+			flush();
+			clearDepthValue = depth;
+			std::fill(tileDepthCleared.begin(), tileDepthCleared.end(), true);
+			float stored = encodeDepth(depthFormat, depth);
+			std::fill(blockDepth.begin(), blockDepth.end(), stored);
+			std::fill(tileDepth.begin(), tileDepth.end(), stored);
+		}
+
+		template <typename T>
+		void Rasterizer::fillTile(T *buffer, int tile, T value)
+		{
+			int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+			if (tiled)
+			{
+				std::fill_n(buffer + sampleIndex(x0, y0), tileSize * tileSize, value);
+				return;
+			}
+			int x1 = std::min(x0 + tileSize, scaledWidth), y1 = std::min(y0 + tileSize, scaledHeight);
+			for (int j = y0; j < y1; j++)
+			{
+				std::fill_n(buffer + sampleIndex(x0, j), x1 - x0, value);
+			}
+		}
+
+		void Rasterizer::fillClearedTile(int tile)
+		{
+			if (tileColorCleared[tile])
+			{
+				fillTile(pbuffer, tile, clearColorValue);
+				if (compression)
+				{
+					// tiles hold whole pixels when compressing
+					int s = supersampling;
+					int px0 = (tile % tilesX) * tileSize / s, py0 = (tile / tilesX) * tileSize / s;
+					int px1 = std::min(px0 + tileSize / s, frameWidth), py1 = std::min(py0 + tileSize / s, frameHeight);
+					for (int py = py0; py < py1; py++)
+					{
+						std::fill(compressed.begin() + px0 + frameWidth * py, compressed.begin() + px1 + frameWidth * py, true);
+					}
+				}
+				tileColorCleared[tile] = false;
+			}
+			if (tileDepthCleared[tile])
+			{
+				float stored = encodeDepth(depthFormat, clearDepthValue);
+				switch (depthFormat)
+				{
+				case DepthFormat::D16: fillTile((Uint16 *)zbuffer, tile, (Uint16)stored); break;
+				case DepthFormat::D24: fillTile((Uint32 *)zbuffer, tile, (Uint32)stored); break;
+				default: fillTile((float *)zbuffer, tile, stored); break;
+				}
+				tileDepthCleared[tile] = false;
+			}
+		}
+
+		float Rasterizer::windowDepth(const glm::vec4 &v, float invW) const
+		{
+			// in [0, 1]; reversed, the projection already maps z to [0, w], so the depth
+			// is stored as it comes and the precision of floats near 0 goes to the far plane
+			return reversedZ ? v[2] * invW : v[2] * invW * 0.5f + 0.5f;
+		}
+
+		bool Rasterizer::setupTriangle(glm::vec4 v4_1, glm::vec4 v4_2, glm::vec4 v4_3, const Attribs *a1, const Attribs *a2, const Attribs *a3, TriangleCache &t)
+		{
+			t.p1 = 1/v4_1[3];
+			t.p2 = 1/v4_2[3];
+			t.p3 = 1/v4_3[3];
+			float z[3] = {windowDepth(v4_1, t.p1), windowDepth(v4_2, t.p2), windowDepth(v4_3, t.p3)};
+			// perspective division
+			v4_1 /= v4_1[3];
+			v4_2 /= v4_2[3];
+			v4_3 /= v4_3[3];
+			// transposed on multiplication with vector
+			glm::mat4x3 scale{
+				scaledWidth / 2.0, 0, 0,
+				0, scaledHeight / 2.0, 0,
+				0, 0, 1,
+				scaledWidth / 2.0, scaledHeight / 2.0, 0};
+
+			glm::vec3 v[3] = {scale * v4_1, scale * v4_2, scale * v4_3};
+
+			// snap to the fixed point grid; also rejects NaNs
+			Sint64 x[3], y[3];
+			for (int k = 0; k < 3; k++)
+			{
+				if (!(std::abs(v[k][0]) < maxCoordinate && std::abs(v[k][1]) < maxCoordinate))
+				{
+					return false;
+				}
+				x[k] = llround(v[k][0] * subPixelOne);
+				y[k] = llround(v[k][1] * subPixelOne);
+			}
+
+			Sint64 area = (x[1] - x[0]) * (y[2] - y[0]) - (y[1] - y[0]) * (x[2] - x[0]);
+			if (area == 0)
+			{
+				return false;
+			}
+			// make the winding counter-clockwise so the inside is where all edges are positive
+			if (area < 0)
+			{
+				std::swap(x[1], x[2]);
+				std::swap(y[1], y[2]);
+				std::swap(v[1], v[2]);
+				std::swap(z[1], z[2]);
+				std::swap(v4_2, v4_3);
+				std::swap(a2, a3);
+				std::swap(t.p2, t.p3);
+				area = -area;
+			}
+			t.a1 = a1;
+			t.a2 = a2;
+			t.a3 = a3;
+
+			// bounding box of the sample centres that can be covered; samples lie up to
+			// sampleOffsetBound from their centres, so the box takes in centres that far out
+			Sint64 xLo = std::min(x[0], std::min(x[1], x[2])) - subPixelOne / 2 - sampleOffsetBound;
+			Sint64 xHi = std::max(x[0], std::max(x[1], x[2])) - subPixelOne / 2 + sampleOffsetBound;
+			Sint64 yLo = std::min(y[0], std::min(y[1], y[2])) - subPixelOne / 2 - sampleOffsetBound;
+			Sint64 yHi = std::max(y[0], std::max(y[1], y[2])) - subPixelOne / 2 + sampleOffsetBound;
+			t.xMin = std::max<Sint64>((xLo + subPixelOne - 1) >> subPixelBits, 0);
+			t.xMax = std::min<Sint64>(xHi >> subPixelBits, scaledWidth - 1);
+			t.yMin = std::max<Sint64>((yLo + subPixelOne - 1) >> subPixelBits, 0);
+			t.yMax = std::min<Sint64>(yHi >> subPixelBits, scaledHeight - 1);
+			if (t.xMin > t.xMax || t.yMin > t.yMax)
+			{
+				return false;
+			}
+
+			// sample centre of (xMin, yMin)
+			Sint64 px = ((Sint64)t.xMin << subPixelBits) + subPixelOne / 2;
+			Sint64 py = ((Sint64)t.yMin << subPixelBits) + subPixelOne / 2;
+			double invArea = 1.0 / area;
+			for (int k = 0; k < 3; k++)
+			{
+				// edge between the other two vertices
+				int k1 = (k + 1) % 3, k2 = (k + 2) % 3;
+				Sint64 a = y[k1] - y[k2];
+				Sint64 b = x[k2] - x[k1];
+				Sint64 c = -a * x[k1] - b * y[k1];
+				t.w0[k] = (a * px + b * py + c) * invArea;
+				t.wdx[k] = a * subPixelOne * invArea;
+				t.wdy[k] = b * subPixelOne * invArea;
+				// top-left fill rule: samples exactly on an edge belong to top and left edges only
+				bool topLeft = a > 0 || (a == 0 && b < 0);
+				t.a[k] = a;
+				t.b[k] = b;
+				t.c[k] = topLeft ? c : c - 1;
+			}
+			t.z0 = z[0] * t.w0[0] + z[1] * t.w0[1] + z[2] * t.w0[2];
+			t.zdx = z[0] * t.wdx[0] + z[1] * t.wdx[1] + z[2] * t.wdx[2];
+			t.zdy = z[0] * t.wdy[0] + z[1] * t.wdy[1] + z[2] * t.wdy[2];
+			return true;
+		}
+
+		// Block coverage kernels
+		// Each one finds the covered samples of a block of blockSize x blockSize samples,
+		// depth tests and writes them if DepthTest, and returns them as bit (i + blockSize*j).
+		// coverage gets the covered samples before the depth test.
+		// Each row of depth is stride after the one below.
+
+		struct BlockEdges {
+			// edge values at the first sample of the block, and their steps between samples
+			Sint64 e[3], stepX[3], stepY[3];
+			// what the sample pattern adds to the edge values of each row and each column
+			Sint32 row[3][blockSize], lane[3][blockSize];
+			// the same offsets of the sample positions, in samples, for depth
+			float rowX[blockSize], laneY[blockSize];
+		};
+
+		typedef Uint64 (*BlockKernel)(const TriangleCache &t, const BlockEdges &b, int x, int y, void *depth, int stride, const DepthCompare &compare, Uint64 &coverage);
+
+		// The depth of the triangle at sample (i, j) displaced by (dx, dy), as every kernel computes it.
+		// It is monotonic in both coordinates, so its extremes over a rectangle are at the corners.
+		inline float depthAt(const TriangleCache &t, float fi, float fj)
+		{
+			return (t.z0 + t.zdy * fj) + t.zdx * fi;
+		}
+
+		// Works on any part of a block (w x h samples) and any edge magnitude.
+		template <typename Depth, bool DepthTest, bool DepthWrite>
+		Uint64 coverBlockScalar(const TriangleCache &t, const BlockEdges &b, int x, int y, int w, int h, void *depthBuffer, int stride, const DepthCompare &compare, Uint64 &coverage)
+		{
+			typename Depth::Type *depth = (typename Depth::Type *)depthBuffer;
+			Uint64 mask = 0;
+			coverage = 0;
+			Sint64 row[3] = {b.e[0], b.e[1], b.e[2]};
+			for (int j = 0; j < h; j++)
+			{
+				float fj = (float)(y + j - t.yMin);
+				Sint64 e1 = row[0] + b.row[0][j], e2 = row[1] + b.row[1][j], e3 = row[2] + b.row[2][j];
+				for (int i = 0; i < w; i++, e1 += b.stepX[0], e2 += b.stepX[1], e3 += b.stepX[2])
+				{
+					// covered when no edge value is negative
+					if (((e1 + b.lane[0][i]) | (e2 + b.lane[1][i]) | (e3 + b.lane[2][i])) < 0)
+					{
+						continue;
+					}
+					coverage |= (Uint64)1 << (i + blockSize * j);
+					if (DepthTest)
+					{
+						float z = encodeDepth<Depth>(depthAt(t, (float)(x + i - t.xMin) + b.rowX[j], fj + b.laneY[i]));
+						if (!depthPasses(compare, z, (float)depth[i + j * stride]))
+						{
+							// hidden, skip
+							continue;
+						}
+						if (DepthWrite)
+						{
+							depth[i + j * stride] = (typename Depth::Type)z;
+						}
+					}
+					mask |= (Uint64)1 << (i + blockSize * j);
+				}
+				for (int k = 0; k < 3; k++)
+				{
+					row[k] += b.stepY[k];
+				}
+			}
+			return mask;
+		}
+
+		template <typename Depth, bool DepthTest, bool DepthWrite>
+		Uint64 coverBlockGeneric(const TriangleCache &t, const BlockEdges &b, int x, int y, void *depth, int stride, const DepthCompare &compare, Uint64 &coverage)
+		{
+			return coverBlockScalar<Depth, DepthTest, DepthWrite>(t, b, x, y, blockSize, blockSize, depth, stride, compare, coverage);
+		}
+
+#ifdef SW_X86
+		// The vector kernels need the edge values of the whole block to fit in 32 bits.
+
+		// Loads and stores of four depths as floats.
+		inline __m128 loadDepth4(const float *d)
+		{
+			return _mm_loadu_ps(d);
+		}
+
+		inline __m128 loadDepth4(const Uint32 *d)
+		{
+			return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)d));
+		}
+
+		inline __m128 loadDepth4(const Uint16 *d)
+		{
+			return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)d), _mm_setzero_si128()));
+		}
+
+		inline void storeDepth4(float *d, __m128 z)
+		{
+			_mm_storeu_ps(d, z);
+		}
+
+		inline void storeDepth4(Uint32 *d, __m128 z)
+		{
+			_mm_storeu_si128((__m128i *)d, _mm_cvttps_epi32(z));
+		}
+
+		inline void storeDepth4(Uint16 *d, __m128 z)
+		{
+			// without SSE4.1 _mm_packus_epi32, shift into the range of signed saturation and back
+			__m128i v = _mm_sub_epi32(_mm_cvttps_epi32(z), _mm_set1_epi32(0x8000));
+			_mm_storel_epi64((__m128i *)d, _mm_xor_si128(_mm_packs_epi32(v, v), _mm_set1_epi16((short)0x8000)));
+		}
+
+		template <typename Depth>
+		inline __m128 encodeDepth4(__m128 z)
+		{
+			z = _mm_min_ps(_mm_max_ps(z, _mm_setzero_ps()), _mm_set1_ps(1.0f));
+			if (!Depth::scale)
+			{
+				return z;
+			}
+			return _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(Depth::scale)), _mm_set1_ps(0.5f))));
+		}
+
+		template <typename Depth, bool DepthTest, bool DepthWrite>
+		Uint64 coverBlockSSE2(const TriangleCache &t, const BlockEdges &b, int x, int y, void *depthBuffer, int stride, const DepthCompare &compare, Uint64 &coverage)
+		{
+			typename Depth::Type *depth = (typename Depth::Type *)depthBuffer;
+			__m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+			__m128i edge[3], step4[3], laneOffset[3][2];
+			for (int k = 0; k < 3; k++)
+			{
+				// lane * stepX without SSE4.1 _mm_mullo_epi32
+				Sint32 s = (Sint32)b.stepX[k];
+				edge[k] = _mm_add_epi32(_mm_set1_epi32((Sint32)b.e[k]), _mm_setr_epi32(0, s, 2 * s, 3 * s));
+				step4[k] = _mm_set1_epi32(4 * s);
+				laneOffset[k][0] = _mm_loadu_si128((const __m128i *)b.lane[k]);
+				laneOffset[k][1] = _mm_loadu_si128((const __m128i *)(b.lane[k] + 4));
+			}
+			__m128 fi = _mm_add_ps(_mm_set1_ps((float)(x - t.xMin)), _mm_cvtepi32_ps(lane));
+			__m128 laneY[2] = {_mm_loadu_ps(b.laneY), _mm_loadu_ps(b.laneY + 4)};
+			__m128 z0 = _mm_set1_ps(t.z0), zdx = _mm_set1_ps(t.zdx), zdy = _mm_set1_ps(t.zdy);
+			// all ones for the orderings that pass
+			__m128 passLess = _mm_setzero_ps(), passEqual = _mm_setzero_ps(), passGreater = _mm_setzero_ps();
+			if (DepthTest)
+			{
+				__m128 ones = _mm_castsi128_ps(_mm_set1_epi32(-1));
+				passLess = compare.less ? ones : passLess;
+				passEqual = compare.equal ? ones : passEqual;
+				passGreater = compare.greater ? ones : passGreater;
+			}
+			Uint64 mask = 0;
+			coverage = 0;
+			for (int j = 0; j < blockSize; j++)
+			{
+				__m128 fj = _mm_set1_ps((float)(y + j - t.yMin));
+				__m128 rowX = _mm_set1_ps(b.rowX[j]);
+				__m128i rowEdge[3];
+				for (int k = 0; k < 3; k++)
+				{
+					rowEdge[k] = _mm_add_epi32(edge[k], _mm_set1_epi32(b.row[k][j]));
+				}
+				for (int half = 0; half < 2; half++)
+				{
+					__m128i e1 = _mm_add_epi32(rowEdge[0], laneOffset[0][half]);
+					__m128i e2 = _mm_add_epi32(rowEdge[1], laneOffset[1][half]);
+					__m128i e3 = _mm_add_epi32(rowEdge[2], laneOffset[2][half]);
+					if (half)
+					{
+						e1 = _mm_add_epi32(e1, step4[0]);
+						e2 = _mm_add_epi32(e2, step4[1]);
+						e3 = _mm_add_epi32(e3, step4[2]);
+					}
+					// sign bit set where any edge is negative
+					__m128i out = _mm_or_si128(_mm_or_si128(e1, e2), e3);
+					int covered = ~_mm_movemask_ps(_mm_castsi128_ps(out)) & 0xF;
+					coverage |= (Uint64)covered << (4 * half + blockSize * j);
+					if (covered && DepthTest)
+					{
+						typename Depth::Type *d = depth + 4 * half + j * stride;
+						__m128 fiHalf = half ? _mm_add_ps(fi, _mm_set1_ps(4.0f)) : fi;
+						__m128 z = _mm_add_ps(_mm_add_ps(z0, _mm_mul_ps(zdy, _mm_add_ps(fj, laneY[half]))), _mm_mul_ps(zdx, _mm_add_ps(fiHalf, rowX)));
+						z = encodeDepth4<Depth>(z);
+						__m128 old = loadDepth4(d);
+						__m128 pass = _mm_or_ps(_mm_or_ps(_mm_and_ps(_mm_cmplt_ps(z, old), passLess), _mm_and_ps(_mm_cmpeq_ps(z, old), passEqual)), _mm_and_ps(_mm_cmpgt_ps(z, old), passGreater));
+						pass = _mm_and_ps(pass, _mm_castsi128_ps(_mm_cmpgt_epi32(out, _mm_set1_epi32(-1))));
+						covered = _mm_movemask_ps(pass);
+						if (DepthWrite)
+						{
+							storeDepth4(d, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old)));
+						}
+					}
+					mask |= (Uint64)covered << (4 * half + blockSize * j);
+				}
+				for (int k = 0; k < 3; k++)
+				{
+					edge[k] = _mm_add_epi32(edge[k], _mm_set1_epi32((Sint32)b.stepY[k]));
+				}
+			}
+			return mask;
+		}
+
+		// Loads and stores of eight depths as floats.
+		__attribute__((target("avx2")))
+		inline __m256 loadDepth8(const float *d)
+		{
+			return _mm256_loadu_ps(d);
+		}
+
+		__attribute__((target("avx2")))
+		inline __m256 loadDepth8(const Uint32 *d)
+		{
+			return _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)d));
+		}
+
+		__attribute__((target("avx2")))
+		inline __m256 loadDepth8(const Uint16 *d)
+		{
+			return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)d)));
+		}
+
+		__attribute__((target("avx2")))
+		inline void storeDepth8(float *d, __m256 z)
+		{
+			_mm256_storeu_ps(d, z);
+		}
+
+		__attribute__((target("avx2")))
+		inline void storeDepth8(Uint32 *d, __m256 z)
+		{
+			_mm256_storeu_si256((__m256i *)d, _mm256_cvttps_epi32(z));
+		}
+
+		__attribute__((target("avx2")))
+		inline void storeDepth8(Uint16 *d, __m256 z)
+		{
+			__m256i v = _mm256_cvttps_epi32(z);
+			_mm_storeu_si128((__m128i *)d, _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+		}
+
+		template <typename Depth>
+		__attribute__((target("avx2")))
+		inline __m256 encodeDepth8(__m256 z)
+		{
+			z = _mm256_min_ps(_mm256_max_ps(z, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+			if (!Depth::scale)
+			{
+				return z;
+			}
+			return _mm256_cvtepi32_ps(_mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(Depth::scale)), _mm256_set1_ps(0.5f))));
+		}
+
+		template <typename Depth, bool DepthTest, bool DepthWrite>
+		__attribute__((target("avx2")))
+		Uint64 coverBlockAVX2(const TriangleCache &t, const BlockEdges &b, int x, int y, void *depthBuffer, int stride, const DepthCompare &compare, Uint64 &coverage)
+		{
+			typename Depth::Type *depth = (typename Depth::Type *)depthBuffer;
+			__m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			__m256i edge[3], rowStep[3];
+			for (int k = 0; k < 3; k++)
+			{
+				edge[k] = _mm256_add_epi32(_mm256_set1_epi32((Sint32)b.e[k]), _mm256_mullo_epi32(lane, _mm256_set1_epi32((Sint32)b.stepX[k])));
+				edge[k] = _mm256_add_epi32(edge[k], _mm256_loadu_si256((const __m256i *)b.lane[k]));
+				rowStep[k] = _mm256_set1_epi32((Sint32)b.stepY[k]);
+			}
+			__m256 fi = _mm256_add_ps(_mm256_set1_ps((float)(x - t.xMin)), _mm256_cvtepi32_ps(lane));
+			__m256 laneY = _mm256_loadu_ps(b.laneY);
+			__m256 z0 = _mm256_set1_ps(t.z0), zdx = _mm256_set1_ps(t.zdx), zdy = _mm256_set1_ps(t.zdy);
+			// all ones for the orderings that pass
+			__m256 passLess = _mm256_setzero_ps(), passEqual = _mm256_setzero_ps(), passGreater = _mm256_setzero_ps();
+			if (DepthTest)
+			{
+				__m256 ones = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+				passLess = compare.less ? ones : passLess;
+				passEqual = compare.equal ? ones : passEqual;
+				passGreater = compare.greater ? ones : passGreater;
+			}
+			Uint64 mask = 0;
+			coverage = 0;
+			for (int j = 0; j < blockSize; j++)
+			{
+				__m256i e1 = _mm256_add_epi32(edge[0], _mm256_set1_epi32(b.row[0][j]));
+				__m256i e2 = _mm256_add_epi32(edge[1], _mm256_set1_epi32(b.row[1][j]));
+				__m256i e3 = _mm256_add_epi32(edge[2], _mm256_set1_epi32(b.row[2][j]));
+				// sign bit set where any edge is negative
+				__m256i out = _mm256_or_si256(_mm256_or_si256(e1, e2), e3);
+				int covered = ~_mm256_movemask_ps(_mm256_castsi256_ps(out)) & 0xFF;
+				coverage |= (Uint64)covered << (blockSize * j);
+				if (covered && DepthTest)
+				{
+					typename Depth::Type *d = depth + j * stride;
+					__m256 fj = _mm256_add_ps(_mm256_set1_ps((float)(y + j - t.yMin)), laneY);
+					__m256 z = _mm256_add_ps(_mm256_add_ps(z0, _mm256_mul_ps(zdy, fj)), _mm256_mul_ps(zdx, _mm256_add_ps(fi, _mm256_set1_ps(b.rowX[j]))));
+					z = encodeDepth8<Depth>(z);
+					__m256 old = loadDepth8(d);
+					__m256 pass = _mm256_or_ps(_mm256_or_ps(_mm256_and_ps(_mm256_cmp_ps(z, old, _CMP_LT_OQ), passLess), _mm256_and_ps(_mm256_cmp_ps(z, old, _CMP_EQ_OQ), passEqual)), _mm256_and_ps(_mm256_cmp_ps(z, old, _CMP_GT_OQ), passGreater));
+					pass = _mm256_and_ps(pass, _mm256_castsi256_ps(_mm256_cmpgt_epi32(out, _mm256_set1_epi32(-1))));
+					covered = _mm256_movemask_ps(pass);
+					if (DepthWrite)
+					{
+						storeDepth8(d, _mm256_blendv_ps(old, z, pass));
+					}
+				}
+				mask |= (Uint64)covered << (blockSize * j);
+				for (int k = 0; k < 3; k++)
+				{
+					edge[k] = _mm256_add_epi32(edge[k], rowStep[k]);
+				}
+			}
+			return mask;
+		}
+#endif
+
+		template <typename Depth, bool DepthTest, bool DepthWrite>
+		BlockKernel selectBlockKernel(CoverageKernel kernel)
+		{
+			if (kernel == CoverageKernel::Scalar)
+			{
+				return coverBlockGeneric<Depth, DepthTest, DepthWrite>;
+			}
+#ifdef SW_X86
+			__builtin_cpu_init();
+			if (kernel != CoverageKernel::SSE2 && __builtin_cpu_supports("avx2"))
+			{
+				return coverBlockAVX2<Depth, DepthTest, DepthWrite>;
+			}
+			return coverBlockSSE2<Depth, DepthTest, DepthWrite>;
+#else
+			return coverBlockGeneric<Depth, DepthTest, DepthWrite>;
+#endif
+		}
+
+		template <typename Depth, bool DepthTest, bool DepthWrite>
+		inline BlockKernel coverBlock(CoverageKernel kernel)
+		{
+			static const BlockKernel kernels[] = {
+				selectBlockKernel<Depth, DepthTest, DepthWrite>(CoverageKernel::Auto),
+				selectBlockKernel<Depth, DepthTest, DepthWrite>(CoverageKernel::Scalar),
+				selectBlockKernel<Depth, DepthTest, DepthWrite>(CoverageKernel::SSE2),
+				selectBlockKernel<Depth, DepthTest, DepthWrite>(CoverageKernel::AVX2)};
+			return kernels[(int)kernel];
+		}
+
+		// The nearest depth of the triangle over the samples [i0, i1] x [j0, j1], given that
+		// sample positions are at most offset samples away from the centres of the grid.
+		// Nearest is the largest when the depth test passes greater depths.
+		template <typename Depth>
+		inline float nearestDepth(const TriangleCache &t, int i0, int j0, int i1, int j1, float offset, bool greater)
+		{
+			float fi0 = (float)(i0 - t.xMin) - offset, fi1 = (float)(i1 - t.xMin) + offset;
+			float fj0 = (float)(j0 - t.yMin) - offset, fj1 = (float)(j1 - t.yMin) + offset;
+			float z00 = depthAt(t, fi0, fj0), z10 = depthAt(t, fi1, fj0), z01 = depthAt(t, fi0, fj1), z11 = depthAt(t, fi1, fj1);
+			float z = greater ? std::max(std::max(z00, z10), std::max(z01, z11)) : std::min(std::min(z00, z10), std::min(z01, z11));
+			return encodeDepth<Depth>(z);
+		}
+
+		// The farthest of the stored depths of w x h samples.
+		template <typename Depth>
+		inline float farthestDepth(const typename Depth::Type *depth, int w, int h, int stride, bool greater)
+		{
+			typename Depth::Type farthest = depth[0];
+			for (int r = 0; r < h; r++)
+			{
+				for (int c = 0; c < w; c++)
+				{
+					typename Depth::Type z = depth[c + r * stride];
+					farthest = greater ? std::min(farthest, z) : std::max(farthest, z);
+				}
+			}
+			return (float)farthest;
+		}
+
+		// Arithmetic on one channel of a fragment, or on the same channel of four, so that
+		// blending is written once for both and gives the same results either way.
+		inline float vadd(float a, float b) { return a + b; }
+		inline float vsub(float a, float b) { return a - b; }
+		inline float vmul(float a, float b) { return a * b; }
+		inline float vmin(float a, float b) { return a < b ? a : b; }
+		inline float vmax(float a, float b) { return a > b ? a : b; }
+#ifdef SW_X86
+		inline __m128 vadd(__m128 a, __m128 b) { return _mm_add_ps(a, b); }
+		inline __m128 vsub(__m128 a, __m128 b) { return _mm_sub_ps(a, b); }
+		inline __m128 vmul(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+		inline __m128 vmin(__m128 a, __m128 b) { return _mm_min_ps(a, b); }
+		inline __m128 vmax(__m128 a, __m128 b) { return _mm_max_ps(a, b); }
+#endif
+
+		// Blend factor f for channel k, from the colours in [0, 1].
+		template <typename V>
+		inline V blendFactor(BlendFactor f, int k, const V src[4], const V dst[4], const V constant[4], V zero, V one)
+		{
+			switch (f)
+			{
+			case BlendFactor::Zero: return zero;
+			case BlendFactor::One: return one;
+			case BlendFactor::SrcColor: return src[k];
+			case BlendFactor::OneMinusSrcColor: return vsub(one, src[k]);
+			case BlendFactor::DstColor: return dst[k];
+			case BlendFactor::OneMinusDstColor: return vsub(one, dst[k]);
+			case BlendFactor::SrcAlpha: return src[3];
+			case BlendFactor::OneMinusSrcAlpha: return vsub(one, src[3]);
+			case BlendFactor::DstAlpha: return dst[3];
+			case BlendFactor::OneMinusDstAlpha: return vsub(one, dst[3]);
+			case BlendFactor::ConstantColor: return constant[k];
+			case BlendFactor::OneMinusConstantColor: return vsub(one, constant[k]);
+			case BlendFactor::ConstantAlpha: return constant[3];
+			default: return vsub(one, constant[3]);
+			}
+		}
+
+		// The blended channels, in [0, 255]. src and dst are in [0, 1], and scaled by 255 in
+		// src255 and dst255, which the equations work on so that One and Zero are exact.
+		template <typename V>
+		inline void blendChannels(const BlendState &blend, const V src[4], const V src255[4], const V dst[4], const V dst255[4], const V constant[4], V zero, V one, V full, V out[4])
+		{
+			for (int k = 0; k < 4; k++)
+			{
+				BlendEquation equation = k < 3 ? blend.colorEquation : blend.alphaEquation;
+				V s = src255[k], d = dst255[k];
+				V sf = blendFactor(k < 3 ? blend.srcColor : blend.srcAlpha, k, src, dst, constant, zero, one);
+				V df = blendFactor(k < 3 ? blend.dstColor : blend.dstAlpha, k, src, dst, constant, zero, one);
+				V c;
+				switch (equation)
+				{
+				case BlendEquation::Add: c = vadd(vmul(s, sf), vmul(d, df)); break;
+				case BlendEquation::Subtract: c = vsub(vmul(s, sf), vmul(d, df)); break;
+				case BlendEquation::ReverseSubtract: c = vsub(vmul(d, df), vmul(s, sf)); break;
+				case BlendEquation::Min: c = vmin(s, d); break;
+				default: c = vmax(s, d); break;
+				}
+				out[k] = vmin(vmax(c, zero), full);
+			}
+		}
+
+		void blendColors(const BlendState &blend, const glm::vec4 src[4], Uint32 dst[4])
+		{
+			Uint32 color[4];
+			if (!blend.enabled)
+			{
+				for (int lane = 0; lane < 4; lane++)
+				{
+					color[lane] = packColor(glm::clamp(src[lane], 0.0f, 1.0f) * 255.0f);
+				}
+			}
+			else
+			{
+#ifdef SW_X86
+				// a channel of the four fragments in each register
+				__m128 s[4], s255[4], d[4], d255[4], c[4], out[4];
+				for (int k = 0; k < 4; k++)
+				{
+					s[k] = _mm_loadu_ps(&src[k][0]);
+				}
+				_MM_TRANSPOSE4_PS(s[0], s[1], s[2], s[3]);
+				__m128i stored = _mm_loadu_si128((const __m128i *)dst);
+				for (int k = 0; k < 4; k++)
+				{
+					s[k] = _mm_min_ps(_mm_max_ps(s[k], _mm_setzero_ps()), _mm_set1_ps(1.0f));
+					s255[k] = _mm_mul_ps(s[k], _mm_set1_ps(255.0f));
+					d255[k] = _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(stored, 8 * k), _mm_set1_epi32(0xFF)));
+					d[k] = _mm_mul_ps(d255[k], _mm_set1_ps(1 / 255.0f));
+					c[k] = _mm_set1_ps(blend.constant[k]);
+				}
+				blendChannels(blend, s, s255, d, d255, c, _mm_setzero_ps(), _mm_set1_ps(1.0f), _mm_set1_ps(255.0f), out);
+				__m128i packed = _mm_setzero_si128();
+				for (int k = 0; k < 4; k++)
+				{
+					packed = _mm_or_si128(packed, _mm_slli_epi32(_mm_cvttps_epi32(out[k]), 8 * k));
+				}
+				_mm_storeu_si128((__m128i *)color, packed);
+#else
+				for (int lane = 0; lane < 4; lane++)
+				{
+					float s[4], s255[4], d[4], d255[4], c[4], out[4];
+					for (int k = 0; k < 4; k++)
+					{
+						s[k] = vmin(vmax(src[lane][k], 0.0f), 1.0f);
+						s255[k] = s[k] * 255.0f;
+						d255[k] = (float)channel(dst[lane], k);
+						d[k] = d255[k] * (1 / 255.0f);
+						c[k] = blend.constant[k];
+					}
+					blendChannels(blend, s, s255, d, d255, c, 0.0f, 1.0f, 255.0f, out);
+					color[lane] = (Uint32)(int)out[0] | (Uint32)(int)out[1] << 8 | (Uint32)(int)out[2] << 16 | (Uint32)(int)out[3] << 24;
+				}
+#endif
+			}
+			for (int lane = 0; lane < 4; lane++)
+			{
+				dst[lane] = (color[lane] & blend.writeMask) | (dst[lane] & ~blend.writeMask);
+			}
+		}
+
+		void Rasterizer::writePixel(int px, int py, Uint64 samples, int bx, int by, Uint32 value)
+		{
+			int s = supersampling;
+			if (compression)
+			{
+				Uint8 &flag = compressed[px + frameWidth * py];
+				Uint32 *first = pbuffer + sampleIndex(px * s, py * s);
+				if (__builtin_popcountll(samples) == s * s)
+				{
+					// covered by this triangle alone, one colour stands for all samples
+					*first = value;
+					flag = true;
+					return;
+				}
+				if (flag)
+				{
+					// partly covered now, so the samples get their own colours
+					for (int r = 0; r < s; r++)
+					{
+						std::fill_n(first + r * sampleRowStride, s, *first);
+					}
+					flag = false;
+				}
+			}
+			while (samples)
+			{
+				int bit = __builtin_ctzll(samples);
+				samples &= samples - 1;
+				int i = bx + bit % blockSize;
+				int j = by + bit / blockSize;
+				pbuffer[sampleIndex(i, j)] = value;
+			}
+		}
+
+		void Rasterizer::blendPixel(int px, int py, Uint64 samples, int bx, int by, const glm::vec4 &color, const BlendState &blend)
+		{
+			int s = supersampling;
+			glm::vec4 src[4] = {color, color, color, color};
+			if (compression)
+			{
+				Uint8 &flag = compressed[px + frameWidth * py];
+				Uint32 *first = pbuffer + sampleIndex(px * s, py * s);
+				if (flag && __builtin_popcountll(samples) == s * s)
+				{
+					// all samples have the same colour before and after
+					Uint32 stored[4] = {*first, *first, *first, *first};
+					blendColors(blend, src, stored);
+					*first = stored[0];
+					return;
+				}
+				if (flag)
+				{
+					for (int r = 0; r < s; r++)
+					{
+						std::fill_n(first + r * sampleRowStride, s, *first);
+					}
+					flag = false;
+				}
+			}
+			// the covered samples, four at a time
+			while (samples)
+			{
+				size_t index[4];
+				Uint32 stored[4] = {};
+				int n = 0;
+				for (; n < 4 && samples; n++)
+				{
+					int bit = __builtin_ctzll(samples);
+					samples &= samples - 1;
+					index[n] = sampleIndex(bx + bit % blockSize, by + bit / blockSize);
+					stored[n] = pbuffer[index[n]];
+				}
+				blendColors(blend, src, stored);
+				for (int k = 0; k < n; k++)
+				{
+					pbuffer[index[k]] = stored[k];
+				}
+			}
+		}
+
+		template <typename Depth, bool DepthTest, bool DepthWrite>
+		void Rasterizer::drawTriangle(const DrawCommand &draw, const TriangleCache &t, int x0, int y0, int x1, int y1, FrameStats &stats)
+		{
+			// only the part of the bounding box inside [x0,x1) x [y0,y1) is drawn,
+			// x0 and y0 must be multiples of blockSize
+			int j_min = std::max(t.yMin, y0);
+			int j_max = std::min(t.yMax, y1 - 1);
+			int i_min = std::max(t.xMin, x0);
+			int i_max = std::min(t.xMax, x1 - 1);
+
+			DepthCompare compare = depthCompare(depthFunc);
+			// the coarse depths bound the stored ones only for tests that pass one direction
+			bool hiz = DepthTest && compare.less != compare.greater;
+			bool greater = compare.greater;
+			float offset = sampleOffsetBound / (float)subPixelOne;
+
+			// the whole triangle is behind everything in this tile
+			int tile = x0 / tileSize + tilesX * (y0 / tileSize);
+			if (hiz && !depthPasses(compare, nearestDepth<Depth>(t, i_min, j_min, i_max, j_max, offset, greater), tileDepth[tile]))
+			{
+				stats.hizTilesRejected++;
+				stats.hizSamplesRejected += (Uint64)(i_max - i_min + 1) * (j_max - j_min + 1);
+				return;
+			}
+			bool tileDepthChanged = false;
+
+			Sint64 stepX[3], stepY[3], margin[3];
+			for (int k = 0; k < 3; k++)
+			{
+				stepX[k] = t.a[k] * subPixelOne;
+				stepY[k] = t.b[k] * subPixelOne;
+				// how far the sample pattern can move edge values from those at the grid
+				margin[k] = (std::abs(t.a[k]) + std::abs(t.b[k])) * sampleOffsetBound;
+			}
+			int s = supersampling;
+			BlockEdges edges;
+
+			// walk the box in aligned blocks; tiles are a multiple of blockSize so blocks stay inside them
+			for (int by = j_min & ~(blockSize - 1); by <= j_max; by += blockSize)
+			{
+				for (int bx = i_min & ~(blockSize - 1); bx <= i_max; bx += blockSize)
+				{
+					// edge values at the first sample centre, and their range over the block
+					Sint64 px = ((Sint64)bx << subPixelBits) + subPixelOne / 2;
+					Sint64 py = ((Sint64)by << subPixelBits) + subPixelOne / 2;
+					bool outside = false, fits = true, inside[3];
+					for (int k = 0; k < 3; k++)
+					{
+						Sint64 e = t.a[k] * px + t.b[k] * py + t.c[k];
+						Sint64 dx = stepX[k] * (blockSize - 1), dy = stepY[k] * (blockSize - 1);
+						Sint64 lo = e + std::min<Sint64>(dx, 0) + std::min<Sint64>(dy, 0) - margin[k];
+						Sint64 hi = e + std::max<Sint64>(dx, 0) + std::max<Sint64>(dy, 0) + margin[k];
+						outside |= hi < 0;
+						// when the whole block is inside this edge, it is left out of the test
+						inside[k] = lo >= 0;
+						edges.e[k] = inside[k] ? 0 : e;
+						edges.stepX[k] = inside[k] ? 0 : stepX[k];
+						edges.stepY[k] = inside[k] ? 0 : stepY[k];
+						if (!inside[k])
+						{
+							fits &= lo >= INT_MIN && hi <= INT_MAX;
+						}
+					}
+					if (outside)
+					{
+						continue;
+					}
+					// column u and row v of each sample within its pixel
+					for (int n = 0, u = bx % s, v = by % s; n < blockSize; n++, u = u + 1 < s ? u + 1 : 0, v = v + 1 < s ? v + 1 : 0)
+					{
+						for (int k = 0; k < 3; k++)
+						{
+							edges.row[k][n] = inside[k] ? 0 : t.a[k] * sampleOffsetX[v];
+							edges.lane[k][n] = inside[k] ? 0 : t.b[k] * sampleOffsetY[u];
+						}
+						edges.rowX[n] = sampleOffsetX[v] / (float)subPixelOne;
+						edges.laneY[n] = sampleOffsetY[u] / (float)subPixelOne;
+					}
+
+					int block = bx / blockSize + blocksX * (by / blockSize);
+					if (hiz)
+					{
+						// the triangle is behind everything in this block
+						int bi0 = std::max(bx, i_min), bi1 = std::min(bx + blockSize - 1, i_max);
+						int bj0 = std::max(by, j_min), bj1 = std::min(by + blockSize - 1, j_max);
+						if (!depthPasses(compare, nearestDepth<Depth>(t, bi0, bj0, bi1, bj1, offset, greater), blockDepth[block]))
+						{
+							stats.hizBlocksRejected++;
+							stats.hizSamplesRejected += (Uint64)(bi1 - bi0 + 1) * (bj1 - bj0 + 1);
+							continue;
+						}
+					}
+
+					int w = std::min(blockSize, std::min(x1, scaledWidth) - bx);
+					int h = std::min(blockSize, std::min(y1, scaledHeight) - by);
+					typename Depth::Type *depth = (typename Depth::Type *)zbuffer + sampleIndex(bx, by);
+					Uint64 coverage;
+					Uint64 mask = (fits && w == blockSize && h == blockSize)
+						? coverBlock<Depth, DepthTest, DepthWrite>(blockKernel)(t, edges, bx, by, depth, sampleRowStride, compare, coverage)
+						: coverBlockScalar<Depth, DepthTest, DepthWrite>(t, edges, bx, by, w, h, depth, sampleRowStride, compare, coverage);
+#if SW_PIPELINE_STATS
+					if (DepthTest)
+					{
+						stats.samplesTested += __builtin_popcountll(coverage);
+						stats.samplesDepthRejected += __builtin_popcountll(coverage & ~mask);
+					}
+					stats.samplesWritten += __builtin_popcountll(mask);
+#endif
+
+					if (hiz && DepthWrite && mask)
+					{
+						blockDepth[block] = farthestDepth<Depth>(depth, w, h, sampleRowStride, greater);
+						tileDepthChanged = true;
+					}
+
+					(this->*draw.blockShader)(draw, t, mask, bx, by, stats);
+				}
+			}
+
+			if (tileDepthChanged)
+			{
+				float farthest = blockDepth[x0 / blockSize + blocksX * (y0 / blockSize)];
+				int bx1 = std::min(x1, scaledWidth), by1 = std::min(y1, scaledHeight);
+				for (int by = y0; by < by1; by += blockSize)
+				{
+					for (int bx = x0; bx < bx1; bx += blockSize)
+					{
+						float z = blockDepth[bx / blockSize + blocksX * (by / blockSize)];
+						farthest = greater ? std::min(farthest, z) : std::max(farthest, z);
+					}
+				}
+				tileDepth[tile] = farthest;
+			}
+		}
+
+		void Rasterizer::binTriangles()
 		{
-			depthTesting = true;
+			for (int d : drawOrder)
+			{
+				const std::vector<TriangleCache> &triangles = commands[d].triangles;
+				for (size_t k = 0; k < triangles.size(); k++)
+				{
+					const TriangleCache &t = triangles[k];
+					for (int ty = t.yMin / tileSize; ty <= t.yMax / tileSize; ty++)
+					{
+						for (int tx = t.xMin / tileSize; tx <= t.xMax / tileSize; tx++)
+						{
+							std::vector<BinnedTriangle> &bin = bins[tx + tilesX * ty];
+							if (bin.empty())
+							{
+								activeTiles.push_back(tx + tilesX * ty);
+							}
+							bin.push_back(BinnedTriangle{d, (int)k});
+						}
+					}
+				}
+			}
 		}
 
-		void Rasterizer::clear(glm::vec4 color)
+		void Rasterizer::rasterizeTiles()
 		{
-			// argument is normalized
-			color *= 255;
-			SDL_PixelFormat *format = framebuffer->format;
-			Uint32 bgColor = SDL_MapRGBA(format, color[0], color[1], color[2], color[3]);
-			std::fill_n(zbuffer, scaledHeight*scaledWidth, 1e8);
-			std::fill_n(pbuffer, scaledHeight*scaledWidth, bgColor);
+			// tiles don't overlap, so no locking is needed on the buffers
+			typedef void (Rasterizer::*DrawTriangle)(const DrawCommand &, const TriangleCache &, int, int, int, int, FrameStats &);
+			// without depth testing, depths are neither read nor written
+			static const DrawTriangle draws[3][3] = {
+				{&Rasterizer::drawTriangle<DepthD16, false, false>, &Rasterizer::drawTriangle<DepthD16, true, false>, &Rasterizer::drawTriangle<DepthD16, true, true>},
+				{&Rasterizer::drawTriangle<DepthD24, false, false>, &Rasterizer::drawTriangle<DepthD24, true, false>, &Rasterizer::drawTriangle<DepthD24, true, true>},
+				{&Rasterizer::drawTriangle<DepthD32F, false, false>, &Rasterizer::drawTriangle<DepthD32F, true, false>, &Rasterizer::drawTriangle<DepthD32F, true, true>}};
+			const DrawTriangle *formatDraws = draws[(int)depthFormat];
+			workers->run(activeTiles.size(), [this, formatDraws](int n)
+			{
+#if SW_PIPELINE_STATS
+				auto start = tracing ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+#endif
+				int tile = activeTiles[n];
+				int x0 = (tile % tilesX) * tileSize;
+				int y0 = (tile / tilesX) * tileSize;
+				fillClearedTile(tile);
+				for (BinnedTriangle k : bins[tile])
+				{
+					const DrawCommand &command = commands[k.draw];
+					DrawTriangle draw = formatDraws[depthTesting ? 1 + command.depthWrite : 0];
+					(this->*draw)(command, command.triangles[k.triangle], x0, y0, x0 + tileSize, y0 + tileSize, tileStats[tile]);
+				}
+#if SW_PIPELINE_STATS
+				if (tracing)
+				{
+					traceEvent("tile", start, std::chrono::steady_clock::now(), "triangles", bins[tile].size());
+				}
+#endif
+				bins[tile].clear();
+			});
+			activeTiles.clear();
 		}
 
-		inline float Rasterizer::get_dist(const glm::vec3 &v1, const glm::vec3 &v2, const glm::vec3 &p)
+		// Sums each channel of the s x s samples starting at first, each row stride after the one below.
+		inline void sumSamples(const Uint32 *first, int stride, int s, Uint32 sum[4])
 		{
-			// not distance but ratio should be ratio of distance
-			return (v2[1] - v1[1]) * (p[0] - v1[0]) - (p[1] - v1[1]) * (v2[0] - v1[0]);
+#ifdef SW_X86
+			// 16 bit lanes hold the sums of up to 257 samples
+			if (s <= 16)
+			{
+				__m128i zero = _mm_setzero_si128(), acc = zero;
+				for (int r = 0; r < s; r++)
+				{
+					const Uint32 *row = first + r * stride;
+					int c = 0;
+					for (; c + 4 <= s; c += 4)
+					{
+						__m128i v = _mm_loadu_si128((const __m128i *)(row + c));
+						acc = _mm_add_epi16(acc, _mm_add_epi16(_mm_unpacklo_epi8(v, zero), _mm_unpackhi_epi8(v, zero)));
+					}
+					if (c + 2 <= s)
+					{
+						acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(row + c)), zero));
+						c += 2;
+					}
+					if (c < s)
+					{
+						acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(_mm_cvtsi32_si128(row[c]), zero));
+					}
+				}
+				acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+				Uint16 lanes[8];
+				_mm_storeu_si128((__m128i *)lanes, acc);
+				for (int k = 0; k < 4; k++)
+				{
+					sum[k] = lanes[k];
+				}
+				return;
+			}
+#endif
+			sum[0] = sum[1] = sum[2] = sum[3] = 0;
+			for (int r = 0; r < s; r++)
+			{
+				for (int c = 0; c < s; c++)
+				{
+					Uint32 rgba = first[c + r * stride];
+					for (int k = 0; k < 4; k++)
+					{
+						sum[k] += channel(rgba, k);
+					}
+				}
+			}
 		}
 
-		inline void Rasterizer::get_barycentric(const glm::vec3 &v1, const glm::vec3 &v2, const glm::vec3 &v3, const glm::vec3 &p, float& t1, float& t2, float& t3)
+		void Rasterizer::updateFrameBuffer()
 		{
-			float d = get_dist(v2, v3, v1);
-			t1 = get_dist(v2, v3, p) / d;
-			t2 = get_dist(v3, v1, p) / d;
-			t3 = get_dist(v1, v2, p) / d;
+			// rows of pixels are resolved in bands, in parallel
+			auto start = std::chrono::steady_clock::now();
+			if (tileSize % supersampling != 0)
+			{
+				// pixels straddle tiles, so cleared tiles are filled first
+				for (int tile = 0; tile < tilesX * tilesY; tile++)
+				{
+					if (tileColorCleared[tile])
+					{
+						fillClearedTile(tile);
+					}
+				}
+			}
+			if (resolveFilter == ResolveFilter::Tent)
+			{
+				tentWeights.resize(3 * supersampling);
+				for (int k = 0; k < 3 * supersampling; k++)
+				{
+					tentWeights[k] = std::max(0.0f, 1 - std::abs((k + 0.5f) / supersampling - 1.5f));
+				}
+			}
+			const int band = 16;
+			workers->run((frameHeight + band - 1) / band, [&](int n)
+			{
+#if SW_PIPELINE_STATS
+				auto bandStart = tracing ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+#endif
+				resolveRows(n * band, std::min(frameHeight, (n + 1) * band));
+#if SW_PIPELINE_STATS
+				if (tracing)
+				{
+					traceEvent("resolve rows", bandStart, std::chrono::steady_clock::now(), "row", n * band);
+				}
+#endif
+			});
+			auto end = std::chrono::steady_clock::now();
+			frameStats.resolveMilliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+#if SW_PIPELINE_STATS
+			if (tracing)
+			{
+				traceEvent("resolve", start, end);
+			}
+#endif
 		}
 
-		void Rasterizer::drawTriangle(glm::vec4 v4_1, glm::vec4 v4_2, glm::vec4 v4_3, glm::vec4 c1, glm::vec4 c2, glm::vec4 c3)
+		void Rasterizer::resolveRows(int j0, int j1)
 		{
-			float p1 = 1/v4_1[3];
-			float p2 = 1/v4_2[3];
-			float p3 = 1/v4_3[3];
-			// perspective division
-			if (depthTesting)
+			if (supersampling > 1 && resolveFilter == ResolveFilter::Tent)
 			{
-				v4_1 /= v4_1[3];
-				v4_2 /= v4_2[3];
-				v4_3 /= v4_3[3];
+				resolveRowsTent(j0, j1);
+				return;
 			}
-			// transposed on multiplication with vector
-			glm::mat4x3 scale{
-				scaledWidth / 2.0, 0, 0,
-				0, scaledHeight / 2.0, 0,
-				0, 0, 1,
-				scaledWidth / 2.0, scaledHeight / 2.0, 0};
-
-			glm::vec3 v1{scale * v4_1}, v2{scale * v4_2}, v3{scale * v4_3};
+			// rows are resolved in spans of one tile, so that tiles which were cleared and
+			// never drawn to are filled with the clear colour without reading them
+			Uint32* pixels = (Uint32*)framebuffer->pixels;
+			Uint32 clearPixel = toSurfaceFormat(clearColorValue, framebuffer->format);
+			int s = supersampling;
+			for (int j = j0; j < j1; j++)
+			{
+				Uint32 *row = pixels + frameWidth * (frameHeight - 1 - j);
+				int ty = j * s / tileSize;
+				for (int tx = 0; tx < tilesX; tx++)
+				{
+					int i0 = tx * tileSize / s, i1 = std::min(frameWidth, (tx + 1) * tileSize / s);
+					if (tileColorCleared[tx + tilesX * ty])
+					{
+						std::fill(row + i0, row + i1, clearPixel);
+						continue;
+					}
+					resolveSpan(row, j, i0, i1);
+				}
+			}
+		}
 
+		void Rasterizer::resolveSpan(Uint32 *row, int j, int i0, int i1)
+		{
 			SDL_PixelFormat *format = framebuffer->format;
-			c1 *= 255;
-			c2 *= 255;
-			c3 *= 255;
-
-			float z1 = v1[2];
-			float z2 = v2[2];
-			float z3 = v3[2];
-			v1[2] = 0;
-			v2[2] = 0;
-			v3[2] = 0;
-
-			// cross product, used when checking if point is in triangle
-			float cp = glm::cross(v2 - v1, v3 - v1)[2];
-
-			float j_min = std::min(v1[1], std::min(v2[1], v3[1]));
-			float j_max = std::max(v1[1], std::max(v2[1], v3[1]));
-			float i_min = std::min(v1[0], std::min(v2[0], v3[0]));
-			float i_max = std::max(v1[0], std::max(v2[0], v3[0]));
-
-			j_min = std::min(std::max(0.0f, j_min), (scaledHeight - 1) * 1.0f);
-			j_max = std::min(std::max(0.0f, j_max), (scaledHeight - 1) * 1.0f);
-			i_min = std::min(std::max(0.0f, i_min), (scaledWidth - 1) * 1.0f);
-			i_max = std::min(std::max(0.0f, i_max), (scaledWidth - 1) * 1.0f);
-
-			for (int j = j_min; j <= j_max; j++)
-			{
-				for (int i = i_min; i <= i_max; i++)
-				{
-					// use previous color as default
-					Uint8 r, g, b, a;
-					SDL_GetRGBA(
-						pbuffer[i + scaledWidth * (scaledHeight - 1 - j)],
-						format, &r, &g, &b, &a);
-					glm::ivec4 pixel_color{r, g, b, a};
-
-					// whether point was inside the triangle or not
-					bool isInside = false;
-
-					// default depth
-					float z = 1e8;
-					if(depthTesting){
-						float w1,w2,w3;
-						get_barycentric(v1, v2, v3,glm::vec3(i+0.5,j+0.5,0),w1,w2,w3);
-						z = (w1*z1 + w2*z2 + w3*z3);
-
-						if(z>=zbuffer[i + scaledWidth * (scaledHeight - 1 - j)]){
-							// far away, skip
-							continue;
-						}
-					}
-					glm::vec3 pos{i + 0.5, j + 0.5, 0};
-					if (// check if pos inside triangle
-						// same side of v1v2 as v3
-						glm::cross(v2 - v1, pos - v1)[2] * cp > 0 &&
-						glm::cross(v3 - v2, pos - v2)[2] * cp  > 0 &&
-						glm::cross(v1 - v3, pos - v3)[2] * cp  > 0)
-					{
-						isInside = true;
-						float w1,w2,w3;
-						get_barycentric(v1, v2, v3,pos,w1,w2,w3);
-						if(depthTesting){
-							pixel_color = (w1*c1*p1 + w2*c2*p2 + w3*c3*p3)/(w1*p1 + w2*p2 + w3*p3);
-						}
-						else{
-							pixel_color = (w1*c1 + w2*c2 + w3*c3);
-						}
+			int s = supersampling;
+			if (s == 1)
+			{
+				// one sample per pixel, in runs of at least a block: only the format changes
+				for (int i = i0; i < i1; i += blockSize)
+				{
+					const Uint32 *samples = pbuffer + sampleIndex(i, j);
+					int n = tiled ? std::min(blockSize, i1 - i) : i1 - i;
+					for (int c = 0; c < n; c++)
+					{
+						row[i + c] = toSurfaceFormat(samples[c], format);
 					}
-					if(!isInside){
-						continue;
-					}					
-					
-					if(!depthTesting || z <= zbuffer[i + scaledWidth * (scaledHeight - 1 - j)]){
-						pbuffer[i + scaledWidth * (scaledHeight - 1 - j)] = SDL_MapRGBA(format, pixel_color[0], pixel_color[1], pixel_color[2], pixel_color[3]);
-						if(depthTesting){
-							zbuffer[i + scaledWidth * (scaledHeight - 1 - j)] = z;
-						}
+					if (!tiled)
+					{
+						return;
 					}
-					
 				}
+				return;
+			}
+			for (int i = i0; i < i1; i++)
+			{
+				const Uint32 *first = pbuffer + sampleIndex(i * s, j * s);
+				if (compression && compressed[i + frameWidth * j])
+				{
+					row[i] = toSurfaceFormat(*first, format);
+					continue;
+				}
+				Uint32 sum[4];
+				sumSamples(first, sampleRowStride, s, sum);
+				row[i] = toSurfaceFormat(sum[0] / (s * s), sum[1] / (s * s), sum[2] / (s * s), sum[3] / (s * s), format);
 			}
 		}
-		void Rasterizer::updateFrameBuffer()
+
+		void Rasterizer::resolveRowsTent(int j0, int j1)
 		{
+			// A tent one pixel wide on each side of the pixel centre, so the samples of
+			// the 3x3 pixels around it count. Weights are the same for every pixel:
+			// weights[s*n + k] is that of row or column k of neighbour n, and
+			// pixelWeights[n] their sum, for compressed neighbours.
 			SDL_PixelFormat *format = framebuffer->format;
 			Uint32* pixels = (Uint32*)framebuffer->pixels;
-			for(int i =0;i<frameWidth;i++){
-				for(int j=0;j<frameHeight;j++){
-					Uint32 alpha = 0;
-					Uint32 red = 0;
-					Uint32 green = 0;
-					Uint32 blue = 0;
-					for(int s_i=i*supersampling;s_i<(i+1)*supersampling;s_i++){
-						for(int s_j=j*supersampling;s_j<(j+1)*supersampling;s_j++){
-							Uint8 r, g, b, a;
-							SDL_GetRGBA(
-								pbuffer[s_i + scaledWidth * (scaledHeight - 1 - s_j)],
-								format, &r, &g, &b, &a);
-							red+=r;
-							green+=g;
-							blue+=b;
-							alpha+=a;
+			int s = supersampling;
+			const float *weights = tentWeights.data();
+			float pixelWeights[3] = {0, 0, 0};
+			for (int k = 0; k < 3 * s; k++)
+			{
+				pixelWeights[k / s] += weights[k];
+			}
+			for (int j = j0; j < j1; j++)
+			{
+				for (int i = 0; i < frameWidth; i++)
+				{
+					float acc[4] = {0, 0, 0, 0}, total = 0;
+					for (int nj = 0; nj < 3; nj++)
+					{
+						int py = j - 1 + nj;
+						if (py < 0 || py >= frameHeight)
+						{
+							continue;
 						}
+						for (int ni = 0; ni < 3; ni++)
+						{
+							int px = i - 1 + ni;
+							if (px < 0 || px >= frameWidth)
+							{
+								continue;
+							}
+							// a single colour for the pixel, if it was never drawn to since the clear or is compressed
+							const Uint32 *first = pbuffer + sampleIndex(px * s, py * s);
+							const Uint32 *single = NULL;
+							if (tileColorCleared[(px * s) / tileSize + tilesX * ((py * s) / tileSize)])
+							{
+								single = &clearColorValue;
+							}
+							else if (compression && compressed[px + frameWidth * py])
+							{
+								single = first;
+							}
+							if (single)
+							{
+								float w = pixelWeights[ni] * pixelWeights[nj];
+								for (int k = 0; k < 4; k++)
+								{
+									acc[k] += w * channel(*single, k);
+								}
+								total += w;
+								continue;
+							}
+							for (int r = 0; r < s; r++)
+							{
+								float wy = weights[s * nj + r];
+								for (int c = 0; c < s; c++)
+								{
+									float w = wy * weights[s * ni + c];
+									Uint32 rgba = first[c + r * sampleRowStride];
+									for (int k = 0; k < 4; k++)
+									{
+										acc[k] += w * channel(rgba, k);
+									}
+									total += w;
+								}
+							}
+						}
+					}
+					pixels[i + frameWidth * (frameHeight - 1 - j)] = toSurfaceFormat(
+						acc[0] / total + 0.5f, acc[1] / total + 0.5f, acc[2] / total + 0.5f, acc[3] / total + 0.5f, format);
+				}
+			}
+		}
+
+		// Clip planes, as distances that are >= 0 inside. Near and far are those of
+		// the view volume, whose depths are in [-gz w, w]; gz is 0 with reversed Z. x and y
+		// are only clipped at the guard band, which is as far out as setupTriangle can still
+		// represent and gx, gy times the screen.
+		static float clipDistance(int plane, const glm::vec4 &v, float gx, float gy, float gz)
+		{
+			switch (plane)
+			{
+			case 0: return gz * v[3] + v[2];
+			case 1: return v[3] - v[2];
+			case 2: return gx * v[3] + v[0];
+			case 3: return gx * v[3] - v[0];
+			case 4: return gy * v[3] + v[1];
+			default: return gy * v[3] - v[1];
+			}
+		}
+		const int clipPlanes = 6;
+
+		// Outcode of a vertex: one bit per clip plane it is outside of.
+		static unsigned clipCode(const glm::vec4 &v, float gx, float gy, float gz)
+		{
+			unsigned code = 0;
+			for (int plane = 0; plane < clipPlanes; plane++)
+			{
+				if (clipDistance(plane, v, gx, gy, gz) < 0)
+				{
+					code |= 1 << plane;
+				}
+			}
+			return code;
+		}
+
+		int Rasterizer::addClipVertex(DrawCommand &draw, int inside, int outside, float t)
+		{
+			// interpolated from the inside vertex, so both triangles sharing a clipped
+			// edge get the same new vertex
+			glm::vec4 position = glm::mix(draw.positions[inside], draw.positions[outside], t);
+			Attribs varyings;
+			const Attribs &a = draw.varyings[inside], &b = draw.varyings[outside];
+			for (int slot = 0; slot < draw.varyingCount; slot++)
+			{
+				varyings.values[slot] = glm::mix(a.values[slot], b.values[slot], t);
+				varyings.dims[slot] = a.dims[slot];
+			}
+			draw.positions.push_back(position);
+			draw.varyings.push_back(varyings);
+			return draw.positions.size() - 1;
+		}
+
+		bool Rasterizer::cullTriangle(DrawCommand &draw, glm::ivec3 triangle)
+		{
+			// The determinant of the (x, y, w) rows has the sign of the area on screen
+			// wherever the triangle is in front of the eye, so facing is known before
+			// the perspective division, even for triangles that have to be clipped.
+			const glm::vec4 &v1 = draw.positions[triangle[0]];
+			const glm::vec4 &v2 = draw.positions[triangle[1]];
+			const glm::vec4 &v3 = draw.positions[triangle[2]];
+			float det = v1[0] * (v2[1] * v3[3] - v3[1] * v2[3])
+				- v2[0] * (v1[1] * v3[3] - v3[1] * v1[3])
+				+ v3[0] * (v1[1] * v2[3] - v2[1] * v1[3]);
+			if (det == 0)
+			{
+				draw.stats.degenerateCulled++;
+				return true;
+			}
+			if (draw.cullMode == CullMode::None)
+			{
+				return false;
+			}
+			bool front = (det > 0) == (draw.frontFace == Winding::CounterClockwise);
+			if (front == (draw.cullMode == CullMode::Front))
+			{
+				draw.stats.facesCulled++;
+				return true;
+			}
+			return false;
+		}
+
+		void Rasterizer::clipTriangle(DrawCommand &draw, glm::ivec3 triangle)
+		{
+			float gx = maxCoordinate / scaledWidth;
+			float gy = maxCoordinate / scaledHeight;
+			float gz = reversedZ ? 0 : 1;
+			unsigned codes[3];
+			for (int k = 0; k < 3; k++)
+			{
+				codes[k] = clipCode(draw.positions[triangle[k]], gx, gy, gz);
+			}
+			if ((codes[0] | codes[1] | codes[2]) == 0)
+			{
+				draw.clipped.push_back(triangle);
+				return;
+			}
+			// outside of one plane of the view volume itself, so nothing is visible
+			unsigned outside = clipCode(draw.positions[triangle[0]], 1, 1, gz)
+				& clipCode(draw.positions[triangle[1]], 1, 1, gz)
+				& clipCode(draw.positions[triangle[2]], 1, 1, gz);
+			if (outside != 0)
+			{
+				draw.stats.primitivesCulled++;
+				return;
+			}
+			draw.stats.primitivesClipped++;
+
+			// Sutherland-Hodgman, each plane adds at most one vertex
+			int polygon[3 + clipPlanes], clipped[3 + clipPlanes];
+			int count = 3;
+			for (int k = 0; k < 3; k++)
+			{
+				polygon[k] = triangle[k];
+			}
+			unsigned planes = codes[0] | codes[1] | codes[2];
+			for (int plane = 0; plane < clipPlanes && count > 0; plane++)
+			{
+				if (!(planes >> plane & 1))
+				{
+					continue;
+				}
+				int clippedCount = 0;
+				for (int k = 0; k < count; k++)
+				{
+					int a = polygon[k], b = polygon[(k + 1) % count];
+					float da = clipDistance(plane, draw.positions[a], gx, gy, gz);
+					float db = clipDistance(plane, draw.positions[b], gx, gy, gz);
+					if (da >= 0)
+					{
+						clipped[clippedCount++] = a;
+					}
+					if ((da >= 0) != (db >= 0))
+					{
+						clipped[clippedCount++] = da >= 0
+							? addClipVertex(draw, a, b, da / (da - db))
+							: addClipVertex(draw, b, a, db / (db - da));
 					}
-					alpha/=supersampling * supersampling;
-					red/=supersampling * supersampling;
-					green/=supersampling * supersampling;
-					blue/=supersampling * supersampling;
-					pixels[i + frameWidth * (frameHeight - 1 - j)] = SDL_MapRGBA(format, red, green, blue, alpha);
 				}
+				count = clippedCount;
+				std::copy(clipped, clipped + count, polygon);
+			}
+			if (count < 3)
+			{
+				draw.stats.primitivesCulled++;
+				return;
+			}
+			for (int k = 1; k + 1 < count; k++)
+			{
+				draw.clipped.push_back(glm::ivec3(polygon[0], polygon[k], polygon[k + 1]));
 			}
 		}
+
 		void Rasterizer::drawObject(const Object &object)
 		{
-			for (glm::ivec3 i : object.indices)
+			// shaders given as function pointers go through the generic instantiation
+			drawObject(object, currentProgram->vs, currentProgram->fs);
+		}
+
+		void Rasterizer::drawObjectInstanced(const Object &object, int instanceCount)
+		{
+			drawObjectInstanced(object, instanceCount, currentProgram->vs, currentProgram->fs);
+		}
+
+		Rasterizer::DrawCommand &Rasterizer::recordDraw(const Object &object, int firstInstance, int instanceCount)
+		{
+			frameStats.primitivesSubmitted += object.indices.size() * instanceCount;
+			if (commandCount == (int)commands.size())
+			{
+				commands.emplace_back();
+			}
+			DrawCommand &draw = commands[commandCount++];
+			draw.object = &object;
+			draw.firstInstance = firstInstance;
+			draw.instanceCount = instanceCount;
+			// only deferred draws need a copy of the uniforms; copying into the last one
+			// recorded in this slot reuses its storage
+			if (currentProgram != NULL && !deferred)
+			{
+				draw.programUniforms = &currentProgram->uniforms;
+			}
+			else
+			{
+				draw.programUniforms = NULL;
+				if (currentProgram != NULL)
+				{
+					draw.savedUniforms = currentProgram->uniforms;
+				}
+				else
+				{
+					draw.savedUniforms.clear();
+				}
+			}
+			draw.cullMode = cullMode;
+			draw.frontFace = frontFace;
+			draw.blend = blendState;
+			draw.depthWrite = depthWrite;
+			return draw;
+		}
+
+		void Rasterizer::countVaryings(DrawCommand &draw, const Attribs &varyings)
+		{
+			draw.varyingCount = 0;
+			for (int slot = 0; slot < Attribs::capacity; slot++)
+			{
+				if (varyings.dims[slot] != 0)
+				{
+					draw.varyingCount = slot + 1;
+				}
+			}
+		}
+
+		void Rasterizer::setupTriangles(DrawCommand &draw)
+		{
+			// clipping may have grown the cache, so varyings are only pointed to now
+			draw.triangles.resize(draw.clipped.size());
+			draw.nearest = INFINITY;
+			bool greater = depthCompare(depthFunc).greater;
+			int n = 0;
+			for (glm::ivec3 i : draw.clipped)
+			{
+				const glm::vec4 &v1 = draw.positions[i[0]], &v2 = draw.positions[i[1]], &v3 = draw.positions[i[2]];
+				if (setupTriangle(v1, v2, v3, &draw.varyings[i[0]], &draw.varyings[i[1]], &draw.varyings[i[2]], draw.triangles[n]))
+				{
+					const TriangleCache &t = draw.triangles[n];
+					float z[3] = {windowDepth(v1, t.p1), windowDepth(v2, t.p2), windowDepth(v3, t.p3)};
+					for (int k = 0; k < 3; k++)
+					{
+						draw.nearest = std::min(draw.nearest, greater ? -z[k] : z[k]);
+					}
+					n++;
+				}
+			}
+			draw.triangles.resize(n);
+		}
+
+		void Rasterizer::setDeferred(bool deferred)
+		{
+			flush();
+			this->deferred = deferred;
+		}
+
+		void Rasterizer::setSortDraws(bool sort)
+		{
+			sortDraws = sort;
+		}
+
+		void Rasterizer::flush()
+		{
+			if (commandCount == 0)
+			{
+				return;
+			}
+			// draws share nothing until they are rasterized, so each runs its vertex
+			// stages, then its setup, on any thread
+			auto start = std::chrono::steady_clock::now();
+			workers->run(commandCount, [this](int n)
+			{
+				DrawCommand &draw = commands[n];
+#if SW_PIPELINE_STATS
+				auto drawStart = tracing ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+#endif
+				(this->*draw.vertexStage)(draw);
+#if SW_PIPELINE_STATS
+				if (tracing)
+				{
+					traceEvent("vertex", drawStart, std::chrono::steady_clock::now(), "triangles", draw.object->indices.size() * draw.instanceCount);
+				}
+#endif
+			});
+			auto shaded = std::chrono::steady_clock::now();
+			frameStats.vertexMilliseconds += std::chrono::duration<double, std::milli>(shaded - start).count();
+			workers->run(commandCount, [this](int n)
+			{
+				DrawCommand &draw = commands[n];
+#if SW_PIPELINE_STATS
+				auto drawStart = tracing ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+#endif
+				setupTriangles(draw);
+#if SW_PIPELINE_STATS
+				if (tracing)
+				{
+					traceEvent("setup", drawStart, std::chrono::steady_clock::now(), "triangles", draw.clipped.size());
+				}
+#endif
+			});
+			auto setUp = std::chrono::steady_clock::now();
+			frameStats.setupMilliseconds += std::chrono::duration<double, std::milli>(setUp - shaded).count();
+
+			drawOrder.resize(commandCount);
+			int triangles = 0;
+			for (int n = 0; n < commandCount; n++)
+			{
+				drawOrder[n] = n;
+				triangles += commands[n].triangles.size();
+			}
+			// only the nearest depth passes tests that pass one direction, whatever the order
+			DepthCompare compare = depthCompare(depthFunc);
+			if (sortDraws && depthTesting && compare.less != compare.greater)
+			{
+				// runs of draws that replace colours and write depths are sorted, between the others
+				std::vector<int>::iterator first = drawOrder.begin();
+				while (first != drawOrder.end())
+				{
+					std::vector<int>::iterator last = std::find_if(first, drawOrder.end(), [this](int n)
+					{
+						return !commands[n].blend.replaces() || !commands[n].depthWrite;
+					});
+					std::stable_sort(first, last, [this](int a, int b)
+					{
+						return commands[a].nearest < commands[b].nearest;
+					});
+					first = last == drawOrder.end() ? last : last + 1;
+				}
+			}
+			binTriangles();
+			rasterizeTiles();
+			auto end = std::chrono::steady_clock::now();
+			frameStats.rasterMilliseconds += std::chrono::duration<double, std::milli>(end - setUp).count();
+#if SW_PIPELINE_STATS
+			if (tracing)
+			{
+				traceEvent("raster", setUp, end, "triangles", triangles);
+			}
+#endif
+
+			for (int n = 0; n < commandCount; n++)
 			{
-				Attribs a1, a2, a3;
-				glm::vec4 v1 = currentProgram->vs(currentProgram->uniforms, object.attribs[i[0]], a1);
-				glm::vec4 v2 = currentProgram->vs(currentProgram->uniforms, object.attribs[i[1]], a2);
-				glm::vec4 v3 = currentProgram->vs(currentProgram->uniforms, object.attribs[i[2]], a3);
-				glm::vec4 c1 = currentProgram->fs(currentProgram->uniforms, a1);
-				glm::vec4 c2 = currentProgram->fs(currentProgram->uniforms, a2);
-				glm::vec4 c3 = currentProgram->fs(currentProgram->uniforms, a3);
-				drawTriangle(v1, v2, v3, c1, c2, c3);
+				frameStats += commands[n].stats;
+				commands[n].stats = FrameStats();
+				// functor shaders may hold resources
+				commands[n].shaders.reset();
 			}
+			commandCount = 0;
 		}
+
 		void Rasterizer::show()
 		{	
+			flush();
 			updateFrameBuffer();
+			for (FrameStats &stats : tileStats)
+			{
+				frameStats += stats;
+				stats = FrameStats();
+			}
+			lastFrameStats = frameStats;
+			frameStats = FrameStats();
+#if SW_PIPELINE_STATS
+			if (tracing)
+			{
+				lastTraceEvents.swap(traceEvents);
+				traceEvents.assign(lastTraceEvents.size(), std::vector<TraceEvent>());
+				traceOrigin = std::chrono::steady_clock::now();
+			}
+#endif
+			if (window == NULL)
+			{
+				// offscreen target, nothing to present
+				return;
+			}
 			SDL_BlitScaled(framebuffer, NULL, windowSurface, NULL);
 			SDL_UpdateWindowSurface(window);
 			SDL_Event e;
@@ -550,9 +2851,68 @@ namespace COL781
 				}
 			}
 		}
-		// Rasterizer::~Rasterizer(){
-		// 	delete[] zbuffer;
-		// 	delete[] pbuffer;
-		// }
+		const FrameStats &Rasterizer::getFrameStats() const
+		{
+			return lastFrameStats;
+		}
+		void Rasterizer::readPixels(Uint8 *rgba)
+		{
+			SDL_PixelFormat *format = framebuffer->format;
+			Uint32* pixels = (Uint32*)framebuffer->pixels;
+			for (int k = 0; k < frameWidth * frameHeight; k++)
+			{
+				SDL_GetRGBA(pixels[k], format, &rgba[4 * k], &rgba[4 * k + 1], &rgba[4 * k + 2], &rgba[4 * k + 3]);
+			}
+		}
+		bool Rasterizer::saveFrame(const std::string &filename)
+		{
+			return SDL_SaveBMP(framebuffer, filename.c_str()) == 0;
+		}
+		void Rasterizer::setTracing(bool enabled)
+		{
+#if SW_PIPELINE_STATS
+			tracing = enabled;
+			traceEvents.assign(workers != NULL ? workers->size() : 1, std::vector<TraceEvent>());
+			lastTraceEvents.clear();
+			traceOrigin = std::chrono::steady_clock::now();
+#endif
+		}
+		void Rasterizer::traceEvent(const char *name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, const char *argName, int arg)
+		{
+			TraceEvent event;
+			event.name = name;
+			event.argName = argName;
+			event.arg = arg;
+			event.start = std::chrono::duration<double, std::micro>(start - traceOrigin).count();
+			event.duration = std::chrono::duration<double, std::micro>(end - start).count();
+			traceEvents[WorkerPool::currentThread()].push_back(event);
+		}
+		bool Rasterizer::saveTrace(const std::string &filename)
+		{
+			// complete ("X") events, one row per thread
+			std::ofstream out(filename);
+			if (!out)
+			{
+				return false;
+			}
+			out << std::fixed << std::setprecision(3) << "{\"traceEvents\": [";
+			const char *separator = "\n";
+			for (size_t thread = 0; thread < lastTraceEvents.size(); thread++)
+			{
+				for (const TraceEvent &event : lastTraceEvents[thread])
+				{
+					out << separator << "  {\"name\": \"" << event.name << "\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << thread
+						<< ", \"ts\": " << event.start << ", \"dur\": " << event.duration;
+					if (event.argName != NULL)
+					{
+						out << ", \"args\": {\"" << event.argName << "\": " << event.arg << "}";
+					}
+					out << "}";
+					separator = ",\n";
+				}
+			}
+			out << "\n], \"displayTimeUnit\": \"ms\"}\n";
+			return out.good();
+		}
 	}
 }
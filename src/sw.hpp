@@ -1,10 +1,22 @@
 #ifndef SW_HPP
 #define SW_HPP
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
 #include <glm/glm.hpp>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <SDL2/SDL.h>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace COL781 {
@@ -13,25 +25,96 @@ namespace COL781 {
 		class Attribs {
 			// A class to contain the attributes of ONE vertex
 		public:
-			// only float, glm::vec2, glm::vec3, glm::vec4 allowed
+			// attribute indices go from 0 to capacity - 1
+			static const int capacity = 16;
+			// only float, glm::vec2, glm::vec3, glm::vec4 allowed; get also allows
+			// glm::mat4, whose columns are in attribIndex to attribIndex + 3
 			template <typename T> T get(int attribIndex) const;
 			template <typename T> void set(int attribIndex, T value);
+			// index of the instance being drawn, for vertex shaders
+			int instanceID() const { return instance; }
 		private:
-			std::vector<glm::vec4> values;
-			std::vector<int> dims;
+			friend class Rasterizer;
+			friend class Texture;
+			// sets an attribute of the given dimension from packed floats
+			void load(int attribIndex, int dim, const float *value);
+			// stored inline, so shading vertices and fragments never allocates
+			glm::vec4 values[capacity];
+			Uint8 dims[capacity] = {};
+			int instance = 0;
+			// the inputs of the quad a fragment is shaded in, whose differences are the
+			// derivatives of its attributes; NULL for vertices
+			const Attribs *quad = NULL;
 		};
 
 		class Uniforms {
 			// A class to contain all the uniform variables
 		public:
-			// any type allowed
+			// Returns the location of the uniform with the given name, giving it one if it
+			// has none. Locations are the same in every program, so shaders can look them up once.
+			static int location(const std::string &name);
+			// Returns the location of the uniform with the given name, or -1 if it has none.
+			// Unlike location(), it takes no lock and adds no names, so shaders may call it.
+			static int find(const std::string &name);
+			// any trivially copyable type allowed
+			template <typename T> T get(int location) const;
 			template <typename T> T get(const std::string &name) const;
+			template <typename T> void set(int location, T value);
 			template <typename T> void set(const std::string &name, T value);
-			~Uniforms();
+			// unsets every uniform, keeping the storage for reuse
+			void clear();
 		private:
-			std::map<std::string,void*> values;
+			struct Slot {
+				int offset = -1;
+				int size = 0;
+			};
+			// values are packed in one block, and found through slots[location]
+			std::vector<Slot> slots;
+			std::vector<glm::vec4> block;
 		};
 
+		template <typename T>
+		inline T Uniforms::get(int location) const
+		{
+			if (location < 0 || location >= (int)slots.size() || slots[location].offset < 0)
+			{
+				throw std::out_of_range("uniform is not set");
+			}
+			T value;
+			std::memcpy((void *)&value, (const void *)&block[slots[location].offset], sizeof(T));
+			return value;
+		}
+
+		template <typename T>
+		inline T Uniforms::get(const std::string &name) const
+		{
+			return get<T>(find(name));
+		}
+
+		template <typename T>
+		inline void Uniforms::set(int location, T value)
+		{
+			if (location >= (int)slots.size())
+			{
+				slots.resize(location + 1);
+			}
+			Slot &slot = slots[location];
+			if (slot.size < (int)sizeof(T))
+			{
+				// new value, or a larger one than before: place it at the end of the block
+				slot.offset = block.size();
+				slot.size = sizeof(T);
+				block.resize(block.size() + (sizeof(T) + sizeof(glm::vec4) - 1) / sizeof(glm::vec4));
+			}
+			std::memcpy((void *)&block[slot.offset], (const void *)&value, sizeof(T));
+		}
+
+		template <typename T>
+		inline void Uniforms::set(const std::string &name, T value)
+		{
+			set<T>(location(name), value);
+		}
+
 		using VertexShader = glm::vec4(*)(const Uniforms &uniforms, const Attribs &in, Attribs &out);
 		using FragmentShader = glm::vec4(*)(const Uniforms &uniforms, const Attribs &in);
 
@@ -41,25 +124,251 @@ namespace COL781 {
 			Uniforms uniforms;
 		};
 
+		template <typename T, size_t Alignment>
+		struct AlignedAllocator {
+			// Allocator for vectors whose storage has to start on an Alignment boundary.
+			typedef T value_type;
+			template <typename U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+			AlignedAllocator() {}
+			template <typename U> AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+			T *allocate(size_t n)
+			{
+				// over-allocate and keep the original pointer just before the aligned block
+				char *raw = (char *)::operator new(n * sizeof(T) + Alignment + sizeof(void *));
+				uintptr_t aligned = ((uintptr_t)(raw + sizeof(void *)) + Alignment - 1) & ~(uintptr_t)(Alignment - 1);
+				((void **)aligned)[-1] = raw;
+				return (T *)aligned;
+			}
+			void deallocate(T *p, size_t) { ::operator delete(((void **)p)[-1]); }
+			template <typename U> bool operator==(const AlignedAllocator<U, Alignment> &) const { return true; }
+			template <typename U> bool operator!=(const AlignedAllocator<U, Alignment> &) const { return false; }
+		};
+
+		struct AttribArray {
+			// One attribute slot of all the vertices, packed as dim floats per vertex.
+			int dim = 0;
+			int count = 0;
+			// one value per instance rather than per vertex
+			bool perInstance = false;
+			std::vector<float, AlignedAllocator<float, 64>> data;
+		};
+
 		struct Object {
-			std::vector<Attribs> attribs;
+			// indexed by attribute slot
+			std::vector<AttribArray> attribs;
+			int nVertices = 0;
 			std::vector<glm::ivec3> indices;
 		};
 
+		// Where the samples of a pixel are placed: on a regular grid, or on a grid
+		// rotated so that no two samples share a row or a column.
+		enum class SamplePattern { OrderedGrid, RotatedGrid };
+
+		// How the samples are averaged into pixels: over the pixel alone, or weighted
+		// by a tent that reaches the centres of the neighbouring pixels.
+		enum class ResolveFilter { Box, Tent };
+
+		// How samples are stored: in rows across the screen, or in square blocks and tiles,
+		// so that samples that are close on screen are close in memory.
+		enum class BufferLayout { Linear, Tiled };
+
+		// Which kernel finds the covered samples of whole blocks: the widest that the CPU
+		// supports, or a given one, to compare them. Kernels the CPU lacks fall back to Auto.
+		enum class CoverageKernel { Auto, Scalar, SSE2, AVX2 };
+
+		// Which faces of triangles are discarded before rasterization.
+		enum class CullMode { None, Front, Back };
+
+		// The order in which the vertices of front faces appear on screen.
+		enum class Winding { CounterClockwise, Clockwise };
+
+		// How depths are stored: as 16 or 24 bit unsigned normalized integers, or as floats.
+		// D24 takes a 32 bit word per sample, with the top byte unused.
+		enum class DepthFormat { D16, D24, D32F };
+
+		// When a fragment passes the depth test, comparing its depth with the stored one.
+		enum class DepthFunc { Never, Less, Equal, LEqual, Greater, NotEqual, GEqual, Always };
+
+		// How textures are filtered: taking the nearest texel, blending the four nearest, or also
+		// blending between the two nearest mipmap levels. The first two use the nearest level.
+		enum class TextureFilter { Nearest, Bilinear, Trilinear };
+
+		// How texture coordinates outside [0, 1] are brought back into the texture.
+		enum class TextureWrap { Repeat, MirroredRepeat, ClampToEdge };
+
+		struct FragmentQuad;
+
+		class Texture {
+			// A mipmapped RGBA8 image, which fragment shaders sample through a uniform.
+		public:
+			// Texture coordinates are (0, 0) at the bottom left corner and (1, 1) at the top right.
+			// dx and dy are how they change to the next pixel right and up, which selects the mipmap level.
+			glm::vec4 sample(glm::vec2 uv, glm::vec2 dx, glm::vec2 dy) const;
+			// Samples at the coordinates in the given attribute of a fragment, with their
+			// differences across its quad as dx and dy.
+			glm::vec4 sample(const Attribs &in, int attribIndex) const;
+			// Samples all four fragments of a quad, sharing the mipmap level and the setup between them.
+			void sample(const FragmentQuad &quad, int attribIndex, glm::vec4 out[4]) const;
+		private:
+			friend class Rasterizer;
+			struct Level {
+				int width = 0, height = 0;
+				// texels in 4x4 tiles, a cache line each, in rows tilesX wide from the bottom up;
+				// see texelIndex in sw.cpp
+				int tilesX = 0;
+				std::vector<Uint32, AlignedAllocator<Uint32, 64>> texels;
+				void resize(int width, int height);
+			};
+			// level of detail of a pixel step: log2 of the number of texels of level 0 it crosses
+			float lod(glm::vec2 dx, glm::vec2 dy) const;
+			// samples n points at level of detail lod, their coordinates in u and v
+			void sample(const float u[4], const float v[4], int n, float lod, glm::vec4 *out) const;
+			void filterLevel(int level, bool linear, const float u[4], const float v[4], int n, glm::vec4 *out) const;
+			// level 0 first, each half the size of the one before
+			std::vector<Level> levels;
+			TextureFilter filter = TextureFilter::Bilinear;
+			TextureWrap wrap = TextureWrap::Repeat;
+		};
+
+		// What blending scales the fragment's colour (the source) and the stored colour (the
+		// destination) by, as in OpenGL. Color factors apply per channel; for alpha they are
+		// the alpha factors. Constant ones take the blend colour.
+		enum class BlendFactor {
+			Zero, One, SrcColor, OneMinusSrcColor, DstColor, OneMinusDstColor,
+			SrcAlpha, OneMinusSrcAlpha, DstAlpha, OneMinusDstAlpha,
+			ConstantColor, OneMinusConstantColor, ConstantAlpha, OneMinusConstantAlpha
+		};
+
+		// How the scaled colours are combined: their sum, either difference, or the smaller or
+		// larger of the two unscaled.
+		enum class BlendEquation { Add, Subtract, ReverseSubtract, Min, Max };
+
+		struct BlendState {
+			// How fragments are combined with the stored colours, and which channels are written.
+			bool enabled = false;
+			BlendFactor srcColor = BlendFactor::One, dstColor = BlendFactor::Zero;
+			BlendFactor srcAlpha = BlendFactor::One, dstAlpha = BlendFactor::Zero;
+			BlendEquation colorEquation = BlendEquation::Add, alphaEquation = BlendEquation::Add;
+			glm::vec4 constant = glm::vec4(0.0f);
+			// bits of the packed colours that are written
+			Uint32 writeMask = 0xFFFFFFFF;
+			// whether fragments just replace the stored colours, needing no read of them
+			bool replaces() const
+			{
+				bool identity = srcColor == BlendFactor::One && dstColor == BlendFactor::Zero && colorEquation == BlendEquation::Add
+					&& srcAlpha == BlendFactor::One && dstAlpha == BlendFactor::Zero && alphaEquation == BlendEquation::Add;
+				return (!enabled || identity) && writeMask == 0xFFFFFFFF;
+			}
+		};
+
+		// Combines the colours of four fragments with the stored colours dst, which are updated;
+		// colours are clamped and converted like unblended ones, so that blending that only
+		// replaces gives the same result.
+		void blendColors(const BlendState &blend, const glm::vec4 src[4], Uint32 dst[4]);
+
+		// side of the square blocks that are covered and depth tested at once, divides Rasterizer::tileSize
+		const int blockSize = 8;
+
+		// Colours are kept as packed RGBA8, red in the lowest byte.
+		inline Uint32 packColor(glm::vec4 color)
+		{
+			// components are in [0, 255]
+			return (Uint32)(Uint8)color[0] | (Uint32)(Uint8)color[1] << 8 | (Uint32)(Uint8)color[2] << 16 | (Uint32)(Uint8)color[3] << 24;
+		}
+
 		struct TriangleCache{
-			glm::vec4 v1,v2,v3;
-			glm::vec4 c1,c2,c3;
+			// edge functions in fixed point, e = a*x + b*y + c at each sample centre,
+			// one per edge opposite each vertex; the sample is covered when all three are >= 0
+			Sint64 a[3], b[3], c[3];
+			// barycentrics and depth as planes over samples, relative to (xMin, yMin)
+			glm::vec3 w0, wdx, wdy;
+			float z0, zdx, zdy;
+			// 1/w of each vertex, for perspective correct interpolation
+			float p1,p2,p3;
+			// varyings of each vertex, in the post-transform cache of the draw
+			const Attribs *a1,*a2,*a3;
+			// bounding box in samples, inclusive and clamped to the screen
+			int xMin,xMax,yMin,yMax;
+		};
+
+		struct FrameStats {
+			// triangles passed to drawObject
+			Uint64 primitivesSubmitted = 0;
+			// vertex and fragment shader invocations; with spp of 9, 25 or 49, the pixels that
+			// straddle blocks are shaded once per block, so fragments can outnumber pixels covered
+			Uint64 verticesShaded = 0;
+			Uint64 fragmentsShaded = 0;
+			// triangles cut by the near/far planes or the guard band, and triangles
+			// dropped entirely for being outside the view volume
+			Uint64 primitivesClipped = 0;
+			Uint64 primitivesCulled = 0;
+			// triangles dropped for facing the culled way, or for having no area
+			Uint64 facesCulled = 0;
+			Uint64 degenerateCulled = 0;
+			// time spent in each stage: shading, culling and clipping vertices, setting up
+			// triangles, binning and rasterizing them, and averaging samples into the framebuffer
+			double vertexMilliseconds = 0;
+			double setupMilliseconds = 0;
+			double rasterMilliseconds = 0;
+			double resolveMilliseconds = 0;
+			// early depth rejection: triangle/tile and triangle/block pairs skipped by the
+			// coarse depth buffer, and how many bounding box samples that saved
+			Uint64 hizTilesRejected = 0;
+			Uint64 hizBlocksRejected = 0;
+			Uint64 hizSamplesRejected = 0;
+			// samples covered by triangles and depth tested, those that failed the test, and
+			// those written; only counted when the rasterizer is built with SW_PIPELINE_STATS
+			Uint64 samplesTested = 0;
+			Uint64 samplesDepthRejected = 0;
+			Uint64 samplesWritten = 0;
+
+			FrameStats &operator+=(const FrameStats &other);
+		};
+
+		class WorkerPool {
+			// A fixed set of threads that run index-parallel tasks.
+			// The calling thread takes part, so a pool of size 1 has no extra threads.
+		public:
+			explicit WorkerPool(int nThreads);
+			~WorkerPool();
+			int size() const;
+			// Runs task(i) for every i in [0, n) and returns once all are done. If a task throws,
+			// the tasks not started yet are skipped and run() rethrows the exception.
+			void run(int n, const std::function<void(int)> &task);
+			// The index in its pool of the thread running a task; 0 for the thread that called run().
+			static int currentThread();
+		private:
+			void work(int index);
+			void drain();
+			std::vector<std::thread> threads;
+			std::mutex mutex;
+			std::condition_variable wake, done;
+			const std::function<void(int)> *task = NULL;
+			int count = 0;
+			std::atomic<int> next;
+			int busy = 0;
+			unsigned generation = 0;
+			bool stopping = false;
+			std::exception_ptr error;
 		};
 
 		// Copied from api.hpp
 		class Rasterizer {
 			public:
-				// ~Rasterizer();
+				Rasterizer() = default;
+				// the rasterizer owns its buffers, window and worker threads, so it can't be copied
+				Rasterizer(const Rasterizer &) = delete;
+				Rasterizer &operator=(const Rasterizer &) = delete;
+				~Rasterizer();
 				/** Windows **/
 
 				// Creates a window with the given title, size, and samples per pixel.
 				bool initialize(const std::string &title, int width, int height, int spp=1);
 
+				// Sets up an offscreen target of the given size and samples per pixel, without a window.
+				// SDL video is never initialized; show() only resolves the frame.
+				bool initializeOffscreen(int width, int height, int spp=1);
+
 				// Returns true if the user has requested to quit the program.
 				bool shouldQuit(); 
 
@@ -75,6 +384,12 @@ namespace COL781 {
 				// T is only allowed to be float, int, glm::vec2/3/4, glm::mat2/3/4.
 				template <typename T> void setUniform(ShaderProgram &program, const std::string &name, T value);
 
+				// Returns the location of a uniform variable, so it can be set without a name lookup.
+				int getUniformLocation(ShaderProgram &program, const std::string &name);
+
+				// Sets the value of the uniform variable at the given location.
+				template <typename T> void setUniform(ShaderProgram &program, int location, T value);
+
 				// Deletes the given shader program.
 				void deleteShaderProgram(ShaderProgram &program);
 
@@ -92,21 +407,165 @@ namespace COL781 {
 				// Sets the indices of the triangles.
 				void setTriangleIndices(Object &object, int n, glm::ivec3* indices);
 
+				// Sets the data for the i'th vertex attribute, with one value per instance instead of per vertex.
+				// T is only allowed to be float, glm::vec2, glm::vec3, glm::vec4, or glm::mat4, which takes
+				// attributes i to i+3, one per column.
+				template <typename T> void setInstanceAttribs(Object &object, int attribIndex, int n, const T* data);
+
+				/** Textures **/
+
+				// Creates an empty texture. Textures are bilinear filtered and repeat by default.
+				Texture createTexture();
+
+				// Sets the image of a texture to width*height RGBA texels, 4 bytes each, in rows from
+				// the bottom up. Any mipmaps are dropped.
+				void setTextureData(Texture &texture, int width, int height, const Uint8 *rgba);
+
+				// Makes the mipmaps of the texture from its image, each level halving the last.
+				void generateMipmaps(Texture &texture);
+
+				// Sets how the texture is filtered, and how coordinates outside it wrap.
+				void setTextureFilter(Texture &texture, TextureFilter filter);
+				void setTextureWrap(Texture &texture, TextureWrap wrap);
+
+				// Sets the texture that the sampler uniform with the given name refers to. Shaders
+				// get it as a const Texture *; it must live as long as the program uses it.
+				void setTexture(ShaderProgram &program, const std::string &name, const Texture &texture);
+
+				// Deletes the given texture.
+				void deleteTexture(Texture &texture);
+
 				/** Drawing **/
 				
 
 				// Enable depth testing.
 				void enableDepthTest();
 
+				// Sets the depth test used when depth testing is enabled. Less by default.
+				void setDepthFunc(DepthFunc func);
+
+				// Sets which faces are culled. Nothing is culled by default.
+				void setCullMode(CullMode mode);
+
+				// Blends fragments with the stored colours instead of replacing them, as in OpenGL. Off by default.
+				void setBlending(bool enabled);
+
+				// Sets the factors of the fragment's colour and of the stored one, for all channels or
+				// separately for alpha. SrcAlpha and OneMinusSrcAlpha composite translucent fragments.
+				// One and Zero by default.
+				void setBlendFunc(BlendFactor src, BlendFactor dst);
+				void setBlendFunc(BlendFactor srcColor, BlendFactor dstColor, BlendFactor srcAlpha, BlendFactor dstAlpha);
+
+				// Sets how the scaled colours are combined, for all channels or separately for alpha. Add by default.
+				void setBlendEquation(BlendEquation equation);
+				void setBlendEquation(BlendEquation color, BlendEquation alpha);
+
+				// Sets the colour that the constant blend factors take. Transparent black by default.
+				void setBlendColor(glm::vec4 color);
+
+				// Sets which channels of the colours, and whether depths, are written. Clears write
+				// them all regardless. Everything is written by default.
+				void setColorMask(bool red, bool green, bool blue, bool alpha);
+				void setDepthMask(bool write);
+
+				// Sets the winding of front faces. Counter-clockwise by default.
+				void setFrontFace(Winding winding);
+
+				// Sets where the samples of each pixel are. Rotated grid by default.
+				void setSamplePattern(SamplePattern pattern);
+
+				// Sets the filter used to average samples into pixels. Box by default.
+				void setResolveFilter(ResolveFilter filter);
+
+				// Sets the layout of the sample buffers, which lose their contents and take the last clear values.
+				// Linear by default. Tiled only applies when blocks hold whole pixels (spp of 1, 4, 16 or 64).
+				void setBufferLayout(BufferLayout layout);
+
+				// Sets the format of the depth buffer, which loses its contents and takes the last clear depth.
+				// D32F by default.
+				void setDepthFormat(DepthFormat format);
+
+				// Takes projections that map the near plane to z = w and the far plane to z = 0, such as
+				// glm::perspectiveRH_ZO(fovy, aspect, far, near), and stores z / w as the depth. Float depths
+				// then stay precise far from the camera. Use with DepthFunc::Greater; clear() then clears to 0.
+				void setReversedZ(bool reversed);
+
+				// Sets the number of threads used for rasterization. 0 uses one per hardware thread.
+				void setThreadCount(int n);
+
+				// Sets the kernel that rasterizes whole blocks. Auto by default.
+				void setBlockKernel(CoverageKernel kernel);
+
 				// Clear the framebuffer, setting all pixels to the given color.
 				void clear(glm::vec4 color);
 
+				// Clears only the colours, or only the depths. Depths are in [0, 1], and the far
+				// plane is at 1, or at 0 with reversed Z. Clears are lazy: tiles are filled when they are first drawn to.
+				void clearColor(glm::vec4 color);
+				void clearDepth(float depth);
+
 				// Draws the triangles of the given object.
 				void drawObject(const Object &object);
 
+				// Draws the triangles of the given object with shaders known at compile time: functors or
+				// lambdas callable like VertexShader and FragmentShader, which are inlined into the pipeline.
+				// They get the uniforms of the current program, if any. Varyings is the number of varying
+				// slots the vertex shader writes, or -1 to find it from the first vertex shaded.
+				// Fragment shaders may instead shade a whole quad at once; see shadeQuad.
+				template <int Varyings = -1, typename VS, typename FS>
+				void drawObject(const Object &object, const VS &vs, const FS &fs);
+
+				// Draws instanceCount copies of the object, which differ in their instance attributes
+				// and in Attribs::instanceID. Their vertices are shaded in batches, on all threads.
+				void drawObjectInstanced(const Object &object, int instanceCount);
+				template <int Varyings = -1, typename VS, typename FS>
+				void drawObjectInstanced(const Object &object, int instanceCount, const VS &vs, const FS &fs);
+
+				// Records draws instead of running them, until flush() or show(). Each keeps a copy of
+				// its shaders, of the uniforms of the current program, of the cull mode and front face,
+				// and of the blend state and write masks; objects, textures, and whatever functor
+				// shaders refer to, must not change until then.
+				// Recorded draws shade their vertices on all threads and are rasterized in one pass.
+				// Clearing, or changing the depth test or the buffers, flushes first. Off by default.
+				void setDeferred(bool deferred);
+
+				// Runs recorded draws that are depth tested with Less, LEqual, Greater or GEqual
+				// nearest first, so that farther ones are rejected early. Draws at equal depths may
+				// then come out differently. Draws that blend, mask colours or don't write depths
+				// depend on what came before, so they keep their place and only the draws between
+				// them are sorted. Off by default.
+				void setSortDraws(bool sort);
+
+				// Runs the recorded draws.
+				void flush();
+
 				// Displays the framebuffer on the screen.
+				// For offscreen targets, only resolves the samples into the framebuffer.
 				void show(); 
 
+				/** Statistics **/
+
+				// Counters collected over the last frame, i.e. between the last two calls to show().
+				const FrameStats &getFrameStats() const;
+
+				/** Offscreen output **/
+
+				// Copies the last shown frame into rgba (width*height*4 bytes, top row first).
+				void readPixels(Uint8 *rgba);
+
+				// Writes the last shown frame to a BMP file.
+				bool saveFrame(const std::string &filename);
+
+				/** Tracing **/
+
+				// Records when each stage runs on each thread. Off by default, and
+				// unavailable when built without SW_PIPELINE_STATS.
+				void setTracing(bool enabled);
+
+				// Writes the stages of the last shown frame as Chrome trace events
+				// (JSON, for chrome://tracing or Perfetto).
+				bool saveTrace(const std::string &filename);
+
 				/** Built-in shaders **/
 
 				// A vertex shader that uses the 0th vertex attribute as the position.
@@ -121,35 +580,472 @@ namespace COL781 {
 				// A vertex shader that handles both transformation and color attributes.
 				VertexShader vsColorTransform();
 
+				// Like vsColorTransform, applying the matrix in attributes 2 to 5, usually set per instance, before 'transform'.
+				VertexShader vsColorTransformInstanced();
+
 				// A fragment shader that returns a constant colour given by the uniform named 'color'.
 				FragmentShader fsConstant(); 
 
 				// A fragment shader that uses the 0th attribute as the color.
 				FragmentShader fsIdentity(); 
 
+				// A vertex shader that applies 'transform' and passes on the 1th attribute as texture coordinates.
+				VertexShader vsTextureTransform();
+
+				// A fragment shader that samples the texture named 'tex' at the coordinates in the 0th attribute.
+				FragmentShader fsTexture();
+
 			private:
-				float get_dist(const glm::vec3& v1, const glm::vec3& v2, const glm::vec3& p);
-				void get_barycentric(const glm::vec3& v1, const glm::vec3& v2, const glm::vec3& v3, const glm::vec3& p, float& t1, float& t2, float& t3);
-				void drawTriangle(glm::vec4 v4_1, glm::vec4 v4_2, glm::vec4 v4_3, glm::vec4 c1, glm::vec4 c2, glm::vec4 c3);
+				struct DrawCommand;
+				// shade the vertices of a draw, and its fragments in a block; see shadeVertices and shadeBlock
+				typedef void (Rasterizer::*VertexStage)(DrawCommand &draw);
+				typedef void (Rasterizer::*BlockShader)(const DrawCommand &draw, const TriangleCache &t, Uint64 mask, int bx, int by, FrameStats &stats);
+				struct DrawCommand {
+					// what was submitted; vs and fs point into shaders, which holds copies of them
+					// for deferred draws, or at the caller's own for immediate ones. Likewise the
+					// uniforms are a snapshot in savedUniforms for deferred draws, and those of the
+					// current program, which can't change before an immediate draw is flushed
+					const Object *object;
+					int firstInstance, instanceCount;
+					const Uniforms *programUniforms;
+					Uniforms savedUniforms;
+					const Uniforms &uniforms() const { return programUniforms != NULL ? *programUniforms : savedUniforms; }
+					std::shared_ptr<void> shaders;
+					const void *vs, *fs;
+					VertexStage vertexStage;
+					BlockShader blockShader;
+					CullMode cullMode;
+					Winding frontFace;
+					BlendState blend;
+					bool depthWrite;
+					// post-transform vertex cache, indexed like Object::attribs for each instance
+					// in turn; vertices made by clipping are added to it after the instances'
+					std::vector<glm::vec4> positions;
+					std::vector<Attribs> varyings;
+					std::vector<char> isShaded;
+					// number of varying slots written by the vertex shader
+					int varyingCount;
+					// triangles left after clipping, as indices into the vertex cache, and set up
+					std::vector<glm::ivec3> clipped;
+					std::vector<TriangleCache> triangles;
+					// depth of the vertex nearest to the eye, negated when the depth test passes
+					// greater depths, so that draws sort nearest first
+					float nearest;
+					// counters of the vertex stages, which may run on any thread
+					FrameStats stats;
+				};
+				DrawCommand &recordDraw(const Object &object, int firstInstance, int instanceCount);
+				template <typename VS, int Varyings> void shadeVertices(DrawCommand &draw);
+				template <typename VS> void shadeVertex(DrawCommand &draw, int index, int cached, const VS &vs, Attribs &input);
+				void countVaryings(DrawCommand &draw, const Attribs &varyings);
+				bool cullTriangle(DrawCommand &draw, glm::ivec3 triangle);
+				void clipTriangle(DrawCommand &draw, glm::ivec3 triangle);
+				int addClipVertex(DrawCommand &draw, int inside, int outside, float t);
+				void setupTriangles(DrawCommand &draw);
+				bool setupTriangle(glm::vec4 v4_1, glm::vec4 v4_2, glm::vec4 v4_3, const Attribs *a1, const Attribs *a2, const Attribs *a3, TriangleCache &t);
+				float windowDepth(const glm::vec4 &v, float invW) const;
+				template <typename Depth, bool DepthTest, bool DepthWrite> void drawTriangle(const DrawCommand &draw, const TriangleCache &t, int x0, int y0, int x1, int y1, FrameStats &stats);
+				template <typename FS, int Varyings, bool Multisample, bool Blend>
+				void shadeBlock(const DrawCommand &draw, const TriangleCache &t, Uint64 mask, int bx, int by, FrameStats &stats);
+				void writePixel(int px, int py, Uint64 samples, int bx, int by, Uint32 value);
+				void blendPixel(int px, int py, Uint64 samples, int bx, int by, const glm::vec4 &color, const BlendState &blend);
+				void binTriangles();
+				void rasterizeTiles();
+				bool createBuffers(int width, int height, int spp);
+				void updateSamplePattern();
+				void allocateSampleBuffers();
+				template <typename T> void fillTile(T *buffer, int tile, T value);
+				void fillClearedTile(int tile);
+				size_t sampleIndex(int i, int j) const;
 				void updateFrameBuffer();
-				// store triangles for the supersampling stage
-				std::vector<TriangleCache> drawnTriangles;
+				void resolveRows(int j0, int j1);
+				void resolveSpan(Uint32 *row, int j, int i0, int i1);
+				void resolveRowsTent(int j0, int j1);
+				void traceEvent(const char *name, std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end, const char *argName = NULL, int arg = 0);
+				// draws recorded since the last flush, the first commandCount of commands; the
+				// others are kept from earlier flushes so that their buffers are reused
+				std::vector<DrawCommand> commands;
+				int commandCount = 0;
+				// the order in which the recorded draws are rasterized
+				std::vector<int> drawOrder;
+				bool deferred = false;
+				bool sortDraws = false;
+				// instanced draws are split into commands of about this many triangles
+				static const int instanceBatchTriangles = 4096;
+
+				// screen tiles of tileSize x tileSize samples, each rasterized by one thread
+				static const int tileSize = 64;
+				int tilesX = 0, tilesY = 0;
+				// triangles overlapping each tile, in drawing order, as indices of the draw and of
+				// the triangle in it
+				struct BinnedTriangle {
+					int draw, triangle;
+				};
+				std::vector<std::vector<BinnedTriangle>> bins;
+				std::vector<int> activeTiles;
+				WorkerPool* workers = NULL;
+				int threadCount = 0;
+				CoverageKernel blockKernel = CoverageKernel::Auto;
+
+				// tiles still holding the last clear values, which aren't written to them yet
+				std::vector<Uint8> tileColorCleared, tileDepthCleared;
+				Uint32 clearColorValue = 0;
+				float clearDepthValue = 1;
+
+				// coarse depth buffer: the farthest depth in each block of samples and in each tile,
+				// as stored; farthest is the largest unless the depth test passes greater depths
+				std::vector<float> blockDepth, tileDepth;
+				int blocksX = 0, blocksY = 0;
+
+				// counters of the frame in progress; raster counters are kept per tile so
+				// that workers never share them, and summed up in show()
+				FrameStats frameStats, lastFrameStats;
+				std::vector<FrameStats> tileStats;
+
+				// stages of the frame in progress and of the last one, with an optional
+				// argument; kept per thread of the pool, times in microseconds since the frame began
+				struct TraceEvent {
+					const char *name, *argName;
+					int arg;
+					double start, duration;
+				};
+				bool tracing = false;
+				std::chrono::steady_clock::time_point traceOrigin;
+				std::vector<std::vector<TraceEvent>> traceEvents, lastTraceEvents;
+
+				// offsets of the samples from the centres of the sample grid, in fixed point;
+				// the x offset depends on the row of the sample in its pixel, the y offset
+				// on the column, and neither is larger than sampleOffsetBound
+				SamplePattern samplePattern = SamplePattern::RotatedGrid;
+				std::vector<int> sampleOffsetX, sampleOffsetY;
+				int sampleOffsetBound = 0;
+				// pixels whose samples all have the colour of the first one, which is the only
+				// one written then; used when pixels never straddle blocks
+				bool compression = false;
+				std::vector<Uint8> compressed;
+				ResolveFilter resolveFilter = ResolveFilter::Box;
+				std::vector<float> tentWeights;
 
 				SDL_Surface* framebuffer = NULL;
-				float* zbuffer = NULL;
+				// samples in depthFormat, 2 or 4 bytes each; see sampleIndex
+				Uint8* zbuffer = NULL;
+				DepthFormat depthFormat = DepthFormat::D32F;
+				bool reversedZ = false;
+				DepthFunc depthFunc = DepthFunc::Less;
+				// packed RGBA8 samples, red in the lowest byte
 				Uint32* pbuffer = NULL;
+				// see sampleIndex; within a block, a row of samples is sampleRowStride after the one below
+				BufferLayout bufferLayout = BufferLayout::Linear;
+				bool tiled = false;
+				size_t sampleCount = 0;
+				int sampleRowStride = 0;
 				SDL_Window* window = NULL;
 				SDL_Surface* windowSurface = NULL;
 
 				bool quit = false;
 				bool depthTesting = false;
+				bool depthWrite = true;
+				BlendState blendState;
+				CullMode cullMode = CullMode::None;
+				Winding frontFace = Winding::CounterClockwise;
 				int supersampling = 1;
 				int frameWidth, frameHeight;
 				int scaledWidth, scaledHeight;
 
-				ShaderProgram* currentProgram;
+				ShaderProgram* currentProgram = NULL;
 			};
 
+		// Where sample (i, j) is stored. Linear buffers are rows from the top of the screen
+		// down. Tiled ones are tiles in rows, each a row of blocks after another, and each
+		// block blockSize rows of samples from the bottom up.
+		inline size_t Rasterizer::sampleIndex(int i, int j) const
+		{
+			if (!tiled)
+			{
+				return i + (size_t)scaledWidth * (scaledHeight - 1 - j);
+			}
+			const int blocksPerTile = tileSize / blockSize;
+			size_t tile = i / tileSize + (size_t)tilesX * (j / tileSize);
+			int block = (i % tileSize) / blockSize + blocksPerTile * ((j % tileSize) / blockSize);
+			return (tile * blocksPerTile * blocksPerTile + block) * blockSize * blockSize + (i % blockSize) + blockSize * (j % blockSize);
+		}
+
+		// The samples of pixel (px, py) inside the block at (bx, by), as a block mask.
+		inline Uint64 pixelSamples(int px, int py, int bx, int by, int s)
+		{
+			int c0 = std::max(px * s, bx) - bx, c1 = std::min(px * s + s, bx + blockSize) - bx;
+			int r0 = std::max(py * s, by) - by, r1 = std::min(py * s + s, by + blockSize) - by;
+			if (c0 >= c1 || r0 >= r1)
+			{
+				return 0;
+			}
+			Uint64 row = (((Uint64)1 << (c1 - c0)) - 1) << c0;
+			Uint64 samples = 0;
+			for (int r = r0; r < r1; r++)
+			{
+				samples |= row << (blockSize * r);
+			}
+			return samples;
+		}
+
+		// The pixels of a 2x2 quad, lanes in the order (0,0), (1,0), (0,1), (1,1).
+		// Inputs are interpolated for all four even where not covered, so that
+		// differences across the quad are available.
+		struct FragmentQuad {
+			Attribs in[4];
+			int covered;
+		};
+
+		// Fragment shaders known at compile time that are callable as fs(uniforms, quad, colors),
+		// with glm::vec4 colors[4], shade the four fragments of a quad in one call, e.g. to sample
+		// textures for all of them at once. Colours of lanes that aren't covered are ignored.
+		template <typename FS>
+		inline auto shadeQuad(const FS &fs, const Uniforms &uniforms, const FragmentQuad &quad, glm::vec4 colors[4], int)
+			-> decltype(fs(uniforms, quad, colors), void())
+		{
+			fs(uniforms, quad, colors);
+		}
+
+		// Other shaders are called for each covered fragment.
+		template <typename FS>
+		inline void shadeQuad(const FS &fs, const Uniforms &uniforms, const FragmentQuad &quad, glm::vec4 colors[4], long)
+		{
+			for (int lane = 0; lane < 4; lane++)
+			{
+				if (quad.covered >> lane & 1)
+				{
+					colors[lane] = fs(uniforms, quad.in[lane]);
+				}
+			}
+		}
+
+		// The stages of the pipeline that are compiled along with the shaders of each draw.
+
+		template <int Varyings, typename VS, typename FS>
+		void Rasterizer::drawObject(const Object &object, const VS &vs, const FS &fs)
+		{
+			drawObjectInstanced<Varyings>(object, 1, vs, fs);
+		}
+
+		template <int Varyings, typename VS, typename FS>
+		void Rasterizer::drawObjectInstanced(const Object &object, int instanceCount, const VS &vs, const FS &fs)
+		{
+			// deferred draws outlive the caller's shaders, so they keep copies of them; draws
+			// that are flushed here can use the caller's own
+			std::shared_ptr<std::pair<VS, FS>> shaders;
+			if (deferred)
+			{
+				shaders = std::make_shared<std::pair<VS, FS>>(vs, fs);
+			}
+			// each batch of instances is a command of its own, so that batches are shaded on
+			// different threads; a batch is at most one thread's share of the instances
+			int triangles = std::max<int>(object.indices.size(), 1);
+			int threads = workers->size();
+			int batch = std::max(1, std::min(instanceBatchTriangles / triangles, (instanceCount + threads - 1) / threads));
+			for (int first = 0; first < instanceCount; first += batch)
+			{
+				DrawCommand &draw = recordDraw(object, first, std::min(batch, instanceCount - first));
+				draw.vs = shaders ? &shaders->first : &vs;
+				draw.fs = shaders ? &shaders->second : &fs;
+				draw.shaders = shaders;
+				draw.vertexStage = &Rasterizer::shadeVertices<VS, Varyings>;
+				// one sample per pixel needs no masks of the samples of each pixel, and
+				// fragments that replace colours need no reads of them
+				static const BlockShader blockShaders[2][2] = {
+					{&Rasterizer::shadeBlock<FS, Varyings, false, false>, &Rasterizer::shadeBlock<FS, Varyings, false, true>},
+					{&Rasterizer::shadeBlock<FS, Varyings, true, false>, &Rasterizer::shadeBlock<FS, Varyings, true, true>}};
+				draw.blockShader = blockShaders[supersampling > 1][!draw.blend.replaces()];
+			}
+			if (!deferred)
+			{
+				flush();
+			}
+		}
+
+		template <typename VS, int Varyings>
+		void Rasterizer::shadeVertices(DrawCommand &draw)
+		{
+			const VS &vs = *(const VS *)draw.vs;
+			const Object &object = *draw.object;
+			// vertices are shaded the first time a triangle uses them, then reused
+			size_t nVertices = object.nVertices;
+			size_t cached = nVertices * draw.instanceCount;
+			draw.positions.resize(cached);
+			draw.varyings.resize(cached);
+			draw.isShaded.assign(cached, false);
+			draw.clipped.clear();
+			draw.varyingCount = Varyings;
+			// inputs of the vertex being shaded, gathered from the object's arrays
+			Attribs input;
+			for (int instance = 0; instance < draw.instanceCount; instance++)
+			{
+				input.instance = draw.firstInstance + instance;
+				for (size_t slot = 0; slot < object.attribs.size(); slot++)
+				{
+					const AttribArray &array = object.attribs[slot];
+					if (array.perInstance && input.instance < array.count)
+					{
+						input.load(slot, array.dim, &array.data[input.instance * array.dim]);
+					}
+				}
+				int base = instance * nVertices;
+				for (glm::ivec3 i : object.indices)
+				{
+					shadeVertex(draw, i[0], base + i[0], vs, input);
+					shadeVertex(draw, i[1], base + i[1], vs, input);
+					shadeVertex(draw, i[2], base + i[2], vs, input);
+					glm::ivec3 triangle(base + i[0], base + i[1], base + i[2]);
+					if (draw.varyingCount < 0)
+					{
+						countVaryings(draw, draw.varyings[triangle[0]]);
+					}
+					if (!cullTriangle(draw, triangle))
+					{
+						clipTriangle(draw, triangle);
+					}
+				}
+			}
+		}
+
+		template <typename VS>
+		inline void Rasterizer::shadeVertex(DrawCommand &draw, int index, int cached, const VS &vs, Attribs &input)
+		{
+			// vertex index of the object goes to cached in the vertex cache
+			if (draw.isShaded[cached])
+			{
+				return;
+			}
+			const Object &object = *draw.object;
+			for (size_t slot = 0; slot < object.attribs.size(); slot++)
+			{
+				const AttribArray &array = object.attribs[slot];
+				if (!array.perInstance && index < array.count)
+				{
+					input.load(slot, array.dim, &array.data[index * array.dim]);
+				}
+			}
+			// the slot may hold the varyings of an earlier draw, which must read as unset
+			Attribs &output = draw.varyings[cached];
+			std::fill(output.dims, output.dims + Attribs::capacity, 0);
+			draw.positions[cached] = vs(draw.uniforms(), input, output);
+			draw.isShaded[cached] = true;
+			draw.stats.verticesShaded++;
+		}
+
+		template <typename FS, int Varyings, bool Multisample, bool Blend>
+		void Rasterizer::shadeBlock(const DrawCommand &draw, const TriangleCache &t, Uint64 mask, int bx, int by, FrameStats &stats)
+		{
+			// fragments are shaded once per pixel at its centre, and the colour is
+			// written to the samples of the pixel that the triangle covers. When s doesn't
+			// divide blockSize (spp of 9, 25 or 49), a pixel whose samples straddle the edge of
+			// a block is shaded again in each block it is in, up to 4 times; blocks and tiles
+			// are rasterized apart, possibly on different threads, so they share no results
+			const FS &fs = *(const FS *)draw.fs;
+			const Uniforms &uniforms = draw.uniforms();
+			int varyings = Varyings >= 0 ? Varyings : draw.varyingCount;
+			int s = Multisample ? supersampling : 1;
+			int px0 = (bx / s) & ~1, px1 = (bx + blockSize - 1) / s;
+			int py0 = (by / s) & ~1, py1 = (by + blockSize - 1) / s;
+			FragmentQuad quad;
+			for (int lane = 0; lane < 4; lane++)
+			{
+				quad.in[lane].quad = quad.in;
+			}
+			glm::vec4 colors[4];
+			Uint64 samples[4];
+			for (int qy = py0; qy <= py1; qy += 2)
+			{
+				for (int qx = px0; qx <= px1; qx += 2)
+				{
+					quad.covered = 0;
+					for (int lane = 0; lane < 4; lane++)
+					{
+						int px = qx + (lane & 1), py = qy + (lane >> 1);
+						// blocks hold whole quads of single samples
+						samples[lane] = mask & (Multisample ? pixelSamples(px, py, bx, by, s) : (Uint64)1 << (px - bx + blockSize * (py - by)));
+						quad.covered |= (samples[lane] != 0) << lane;
+					}
+					if (!quad.covered)
+					{
+						continue;
+					}
+
+					// perspective correct barycentrics of each lane
+					float b[4][3];
+					for (int lane = 0; lane < 4; lane++)
+					{
+						float fi = (qx + (lane & 1) + 0.5f) * s - 0.5f - t.xMin;
+						float fj = (qy + (lane >> 1) + 0.5f) * s - 0.5f - t.yMin;
+						glm::vec3 w = t.w0 + t.wdy * fj + t.wdx * fi;
+						float b1 = w[0] * t.p1, b2 = w[1] * t.p2, b3 = w[2] * t.p3;
+						float norm = 1 / (b1 + b2 + b3);
+						b[lane][0] = b1 * norm;
+						b[lane][1] = b2 * norm;
+						b[lane][2] = b3 * norm;
+					}
+					for (int slot = 0; slot < varyings; slot++)
+					{
+						const glm::vec4 &v1 = t.a1->values[slot], &v2 = t.a2->values[slot], &v3 = t.a3->values[slot];
+						for (int lane = 0; lane < 4; lane++)
+						{
+							quad.in[lane].values[slot] = b[lane][0] * v1 + b[lane][1] * v2 + b[lane][2] * v3;
+							quad.in[lane].dims[slot] = t.a1->dims[slot];
+						}
+					}
+
+					shadeQuad(fs, uniforms, quad, colors, 0);
+					if (Blend && !Multisample)
+					{
+						// the quad's pixels are read, blended and written back together
+						size_t index[4];
+						Uint32 stored[4] = {};
+						for (int lane = 0; lane < 4; lane++)
+						{
+							if (quad.covered >> lane & 1)
+							{
+								index[lane] = sampleIndex(qx + (lane & 1), qy + (lane >> 1));
+								stored[lane] = pbuffer[index[lane]];
+							}
+						}
+						blendColors(draw.blend, colors, stored);
+						for (int lane = 0; lane < 4; lane++)
+						{
+							if (quad.covered >> lane & 1)
+							{
+								pbuffer[index[lane]] = stored[lane];
+								stats.fragmentsShaded++;
+							}
+						}
+						continue;
+					}
+					for (int lane = 0; lane < 4; lane++)
+					{
+						if (!(quad.covered >> lane & 1))
+						{
+							continue;
+						}
+						int px = qx + (lane & 1), py = qy + (lane >> 1);
+						if (Blend)
+						{
+							blendPixel(px, py, samples[lane], bx, by, colors[lane], draw.blend);
+							stats.fragmentsShaded++;
+							continue;
+						}
+						Uint32 color = packColor(glm::clamp(colors[lane], 0.0f, 1.0f) * 255.0f);
+						if (Multisample)
+						{
+							writePixel(px, py, samples[lane], bx, by, color);
+						}
+						else
+						{
+							pbuffer[sampleIndex(px, py)] = color;
+						}
+						stats.fragmentsShaded++;
+					}
+				}
+			}
+		}
+
 	}
 }
 